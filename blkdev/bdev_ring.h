@@ -0,0 +1,84 @@
+/*
+ * Shared-memory command ring between the bdev driver and a
+ * userspace daemon, used when the module is loaded with
+ * userspace=1. Included by both the driver and the daemon.
+ *
+ * Each device gets a control device, /dev/<disk>-ctl. The daemon
+ * opens it, maps the first page to read map_size from the header
+ * and then maps map_size bytes at offset 0, which gives it:
+ *
+ *	struct bdev_ring_hdr		at 0
+ *	struct bdev_ring_sqe[depth]	at sqes_off
+ *	struct bdev_ring_cqe[depth]	at cqes_off
+ *	data buffers, buf_size each	at bufs_off
+ *
+ * The driver adds a submission entry at sq_tail for every request
+ * and the daemon consumes them, moving sq_head along. Each entry
+ * names a tag; tag n owns the nth data buffer for as long as the
+ * request is outstanding. Writes arrive with their data already in
+ * the buffer and reads leave theirs there. The daemon completes a
+ * request by adding a completion entry at cq_tail, and then calls
+ * BDEV_RING_IOC_ENTER so the driver reaps it. Indices only ever
+ * count up; use index % depth to find the entry. Each side only
+ * writes its own two indices, with release semantics, and reads
+ * the other side's with acquire semantics.
+ */
+
+#ifndef _BDEV_RING_H_
+#define _BDEV_RING_H_
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define BDEV_RING_MAX_DEPTH		64
+#define BDEV_RING_BUF_SIZE		(256 * 1024)	// Largest request, in bytes
+
+enum bdev_ring_op {
+	BDEV_RING_OP_READ,
+	BDEV_RING_OP_WRITE,
+	BDEV_RING_OP_FLUSH,
+	BDEV_RING_OP_DISCARD,
+	BDEV_RING_OP_WRITE_ZEROES,
+};
+
+// Submission entry flags
+#define BDEV_RING_F_FUA			(1 << 0)		// Make the write durable before completing
+
+struct bdev_ring_hdr {
+	__u32 sq_head;				// Written by the daemon
+	__u32 sq_tail;				// Written by the driver
+	__u32 cq_head;				// Written by the driver
+	__u32 cq_tail;				// Written by the daemon
+	__u32 depth;				// Entries in each ring
+	__u32 buf_size;				// Bytes per data buffer
+	__u64 dev_size;				// Device size in bytes
+	__u64 sqes_off;
+	__u64 cqes_off;
+	__u64 bufs_off;
+	__u64 map_size;				// Bytes to mmap
+};
+
+struct bdev_ring_sqe {
+	__u8 op;					// enum bdev_ring_op
+	__u8 flags;
+	__u16 tag;
+	__u32 len;					// Bytes
+	__u64 offset;				// Byte offset into the device
+};
+
+struct bdev_ring_cqe {
+	__u16 tag;
+	__u16 pad;
+	__s32 result;				// 0 or a negative errno
+};
+
+/*
+ * Reaps any completions the daemon has posted. The argument is a
+ * flags value, not a pointer. With BDEV_RING_ENTER_WAIT it then
+ * sleeps until there's at least one submission to consume. Returns
+ * the number of submissions waiting.
+ */
+#define BDEV_RING_ENTER_WAIT	(1 << 0)
+#define BDEV_RING_IOC_ENTER		_IO('b', 0x40)
+
+#endif /* _BDEV_RING_H_ */
@@ -0,0 +1,107 @@
+/*
+ * Tracepoints for the bdev I/O path. These replace the printk
+ * calls that used to run on every request and segment. They
+ * cost nothing while disabled and can be turned on through
+ * tracefs:
+ *
+ *	echo 1 > /sys/kernel/tracing/events/bdev/enable
+ *	cat /sys/kernel/tracing/trace_pipe
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM bdev
+
+#if !defined(_BDEV_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _BDEV_TRACE_H_
+
+#include <linux/tracepoint.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+
+TRACE_EVENT(bdev_submit,
+
+	TP_PROTO(struct request *rq),
+
+	TP_ARGS(rq),
+
+	TP_STRUCT__entry(
+		__array(char, disk, DISK_NAME_LEN)
+		__field(unsigned int, op)
+		__field(sector_t, sector)
+		__field(unsigned int, nr_sectors)
+		__field(int, tag)
+	),
+
+	TP_fast_assign(
+		memcpy(__entry->disk, rq->rq_disk->disk_name, DISK_NAME_LEN);
+		__entry->op = req_op(rq);
+		__entry->sector = blk_rq_pos(rq);
+		__entry->nr_sectors = blk_rq_sectors(rq);
+		__entry->tag = rq->tag;
+	),
+
+	TP_printk("%s tag=%d op=%s sector=%llu nr_sectors=%u",
+		__entry->disk, __entry->tag, blk_op_str(__entry->op),
+		(unsigned long long) __entry->sector, __entry->nr_sectors)
+);
+
+TRACE_EVENT(bdev_transfer,
+
+	TP_PROTO(struct request *rq, sector_t sector, unsigned int len, bool write),
+
+	TP_ARGS(rq, sector, len, write),
+
+	TP_STRUCT__entry(
+		__array(char, disk, DISK_NAME_LEN)
+		__field(int, tag)
+		__field(sector_t, sector)
+		__field(unsigned int, len)
+		__field(bool, write)
+	),
+
+	TP_fast_assign(
+		memcpy(__entry->disk, rq->rq_disk->disk_name, DISK_NAME_LEN);
+		__entry->tag = rq->tag;
+		__entry->sector = sector;
+		__entry->len = len;
+		__entry->write = write;
+	),
+
+	TP_printk("%s tag=%d %s sector=%llu len=%u",
+		__entry->disk, __entry->tag, __entry->write ? "write" : "read",
+		(unsigned long long) __entry->sector, __entry->len)
+);
+
+TRACE_EVENT(bdev_complete,
+
+	TP_PROTO(struct request *rq, blk_status_t status),
+
+	TP_ARGS(rq, status),
+
+	TP_STRUCT__entry(
+		__array(char, disk, DISK_NAME_LEN)
+		__field(int, tag)
+		__field(sector_t, sector)
+		__field(int, error)
+	),
+
+	TP_fast_assign(
+		memcpy(__entry->disk, rq->rq_disk->disk_name, DISK_NAME_LEN);
+		__entry->tag = rq->tag;
+		__entry->sector = blk_rq_pos(rq);
+		__entry->error = blk_status_to_errno(status);
+	),
+
+	TP_printk("%s tag=%d sector=%llu error=%d",
+		__entry->disk, __entry->tag,
+		(unsigned long long) __entry->sector, __entry->error)
+);
+
+#endif /* _BDEV_TRACE_H_ */
+
+/* This part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE bdev_trace
+#include <trace/define_trace.h>
@@ -8,6 +8,40 @@
 #include <linux/types.h>
 #include <linux/slab.h>
 #include <linux/blk-mq.h>
+#include <linux/cpumask.h>
+#include <linux/xarray.h>
+#include <linux/highmem.h>
+#include <linux/rwsem.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/hrtimer.h>
+#include <linux/bit_spinlock.h>
+#include <linux/zsmalloc.h>
+#include <linux/crypto.h>
+#include <crypto/hash.h>
+#include <linux/sysfs.h>
+#include <linux/nodemask.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/bitmap.h>
+#include <linux/lockdep.h>
+#include <linux/refcount.h>
+#include <linux/miscdevice.h>
+#include <linux/vmalloc.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/uio.h>
+#include <linux/wait_bit.h>
+#include <linux/sched/mm.h>
+
+#include "bdev_ring.h"
+
+#define CREATE_TRACE_POINTS
+#include "bdev_trace.h"
 
 /*
  * Provide module metadata
@@ -18,186 +52,4130 @@ MODULE_LICENSE("GPL");
 
 #define DEVICE_NAME "bdev"
 #define KERNEL_SECTOR_SIZE 512
+#define PAGE_SECTORS (PAGE_SIZE / KERNEL_SECTOR_SIZE)
+
+static int bdev_major = 0;
+static int dev_sector_size = 512;
+static int num_sectors = 1024;
+static int num_devices = 4;
+static int bdev_minors = 16;
+static int max_snapshots = 8;
+static int nr_hw_queues = 0;		// 0 = one per online CPU
+static int hw_queue_depth = 128;
+
+module_param(bdev_major, int, S_IRUGO);
+module_param(dev_sector_size, int, S_IRUGO);
+module_param(num_sectors, int, S_IRUGO);
+module_param(num_devices, int, S_IRUGO);
+module_param(bdev_minors, int, S_IRUGO);
+module_param(max_snapshots, int, S_IRUGO);
+MODULE_PARM_DESC(max_snapshots, "Number of snapshot devices that can be created (default: 8)");
+module_param(nr_hw_queues, int, S_IRUGO);
+MODULE_PARM_DESC(nr_hw_queues, "Number of hardware queues per device (default: online CPUs)");
+module_param(hw_queue_depth, int, S_IRUGO);
+MODULE_PARM_DESC(hw_queue_depth, "Tags per hardware queue (default: 128)");
+
+/*
+ * Polled queues (HCTX_TYPE_POLL) for io_uring/hipri I/O. Requests
+ * on these are completed from ->poll on the submitting CPU rather
+ * than through the normal completion path.
+ */
+static int poll_queues = 1;
+module_param(poll_queues, int, S_IRUGO);
+MODULE_PARM_DESC(poll_queues, "Number of polled hardware queues per device (default: 1)");
+
+/*
+ * Settings for loading with hundreds of devices. shared_tags gives
+ * every device the same tag set, so the preallocated requests are
+ * paid for once rather than per device; blk-mq then splits the tags
+ * fairly between the queues that are busy. lazy only sets a device
+ * up the first time its device node is opened, the way brd does.
+ */
+static bool shared_tags = false;
+static bool lazy = false;
+
+module_param(shared_tags, bool, S_IRUGO);
+MODULE_PARM_DESC(shared_tags, "Share one tag set between all devices (default: off)");
+module_param(lazy, bool, S_IRUGO);
+MODULE_PARM_DESC(lazy, "Create devices on first open instead of at load (default: off)");
+
+/*
+ * Request size limits. The defaults let a 1 MiB request made of
+ * 4K pages through in one piece instead of splitting it up.
+ */
+static int max_hw_sectors = 2048;
+static int max_segment_size = 1 << 20;
+static int max_segments = 256;
+
+module_param(max_hw_sectors, int, S_IRUGO);
+MODULE_PARM_DESC(max_hw_sectors, "Maximum request size in 512 byte sectors (default: 2048)");
+module_param(max_segment_size, int, S_IRUGO);
+MODULE_PARM_DESC(max_segment_size, "Maximum segment size in bytes (default: 1 MiB)");
+module_param(max_segments, int, S_IRUGO);
+MODULE_PARM_DESC(max_segments, "Maximum number of segments per request (default: 256)");
+
+/*
+ * Device model for benchmarking, along the lines of null_blk. The
+ * data path is the same in every mode, only the way a finished
+ * request is handed back to the block layer changes:
+ *
+ *	0 (none)	completed inline from ->queue_rq
+ *	1 (softirq)	completed through blk_mq_complete_request()
+ *	2 (timer)	completed completion_nsec later from an hrtimer
+ *
+ * mbps caps each device's bandwidth, 0 leaves it unlimited.
+ */
+enum {
+	BDEV_IRQ_NONE		= 0,
+	BDEV_IRQ_SOFTIRQ	= 1,
+	BDEV_IRQ_TIMER		= 2,
+};
+
+static int irqmode = BDEV_IRQ_NONE;
+static unsigned long completion_nsec = 10000;
+static unsigned int mbps = 0;
+
+module_param(irqmode, int, S_IRUGO);
+MODULE_PARM_DESC(irqmode, "Completion mode: 0-none, 1-softirq, 2-timer (default: 0)");
+module_param(completion_nsec, ulong, S_IRUGO);
+MODULE_PARM_DESC(completion_nsec, "Per-request latency in ns for irqmode=2 (default: 10000)");
+module_param(mbps, uint, S_IRUGO);
+MODULE_PARM_DESC(mbps, "Bandwidth cap per device in MB/s, 0 for none (default: 0)");
+
+// The bandwidth budget is refilled once per tick
+#define BDEV_BW_TICK_NS NSEC_PER_MSEC
+#define BDEV_BW_BURST_TICKS 10			// Most budget that can build up while idle
+
+/*
+ * Transparent compression of backing pages, zram style. Pages are
+ * compressed with comp_algorithm through the crypto API into a
+ * zsmalloc pool shared by all devices. Pages that don't shrink
+ * below BDEV_HUGE_SIZE are stored as they are.
+ */
+static bool compress = false;
+static char *comp_algorithm = "lz4";
+
+module_param(compress, bool, S_IRUGO);
+MODULE_PARM_DESC(compress, "Compress backing pages (default: off)");
+module_param(comp_algorithm, charp, S_IRUGO);
+MODULE_PARM_DESC(comp_algorithm, "Compression algorithm when compress=1 (default: lz4)");
+
+#define BDEV_HUGE_SIZE (PAGE_SIZE / 4 * 3)
+
+/*
+ * End-to-end integrity. A crc32c of every 512 byte sector is kept
+ * in a side array, generated as writes come in and checked before
+ * reads complete, so anything that corrupts data on its way through
+ * the cache, compression or the store fails the read with
+ * BLK_STS_PROTECTION. The checksum comes from the crypto API, which
+ * picks the fastest crc32c the CPU supports. Devices can also be
+ * switched over individually through sysfs.
+ */
+static bool integrity = false;
+
+module_param(integrity, bool, S_IRUGO);
+MODULE_PARM_DESC(integrity, "Checksum every sector and verify on read (default: off)");
+
+/*
+ * Volatile write cache size in MB. 0 keeps the device write-through,
+ * anything else advertises a write-back cache with FUA support.
+ */
+static int cache_size = 0;
+
+module_param(cache_size, int, S_IRUGO);
+MODULE_PARM_DESC(cache_size, "Volatile write cache size in MB, 0 for write-through (default: 0)");
+
+/*
+ * Image files to start devices from, one per device in order
+ * (backing_file=/img/a,/img/b). Nothing is read at load; pages are
+ * read in from the file the first time they're accessed, and the
+ * device is the size of the file unless the file is empty. Changes
+ * stay in memory until written back through sysfs.
+ */
+#define BDEV_MAX_BACKING 16
+
+static char *backing_file[BDEV_MAX_BACKING];
+static int nr_backing_file = 0;
+
+module_param_array(backing_file, charp, &nr_backing_file, S_IRUGO);
+MODULE_PARM_DESC(backing_file, "Image file for each device, read in on demand");
+
+/*
+ * Where backing pages are allocated on NUMA machines:
+ *
+ *	0 (device)	on the device's home_node (home_node=N0,N1,...
+ *			gives one node per device, unset means no preference)
+ *	1 (interleave)	spread across online nodes by page offset
+ *	2 (local)	on the node of the CPU, and so the hctx, that
+ *			first writes the page
+ *
+ * Compressed data lives in the zsmalloc pool, which does its own
+ * placement; this only covers raw pages.
+ */
+enum {
+	BDEV_NUMA_DEVICE		= 0,
+	BDEV_NUMA_INTERLEAVE	= 1,
+	BDEV_NUMA_LOCAL			= 2,
+};
+
+static int numa_policy = BDEV_NUMA_DEVICE;
+static int home_node[MAX_NUMNODES];
+static int nr_home_node = 0;
+
+module_param(numa_policy, int, S_IRUGO);
+MODULE_PARM_DESC(numa_policy, "Backing page placement: 0-device, 1-interleave, 2-local (default: 0)");
+module_param_array(home_node, int, &nr_home_node, S_IRUGO);
+MODULE_PARM_DESC(home_node, "Home NUMA node of each device for numa_policy=0");
+
+/*
+ * Pages written as one repeated word (most often all zeros) are
+ * stored as just the word. Reads fill the page back in from it.
+ */
+static bool same_filled = true;
+module_param(same_filled, bool, S_IRUGO);
+MODULE_PARM_DESC(same_filled, "Store same-filled pages as a pattern (default: on)");
+
+/*
+ * Zoned block device emulation (host-managed, like ZNS or SMR).
+ * Sizes are in MB; zone_size must be a power of two. 0 for either
+ * limit means no limit.
+ */
+static bool zoned = false;
+static int zone_size = 256;
+static int zone_nr_conv = 1;
+static int zone_max_open = 0;
+static int zone_max_active = 0;
+
+module_param(zoned, bool, S_IRUGO);
+MODULE_PARM_DESC(zoned, "Expose devices as host-managed zoned devices (default: off)");
+module_param(zone_size, int, S_IRUGO);
+MODULE_PARM_DESC(zone_size, "Zone size in MB, power of two (default: 256)");
+module_param(zone_nr_conv, int, S_IRUGO);
+MODULE_PARM_DESC(zone_nr_conv, "Number of conventional zones (default: 1)");
+module_param(zone_max_open, int, S_IRUGO);
+MODULE_PARM_DESC(zone_max_open, "Maximum number of open zones, 0 for no limit (default: 0)");
+module_param(zone_max_active, int, S_IRUGO);
+MODULE_PARM_DESC(zone_max_active, "Maximum number of active zones, 0 for no limit (default: 0)");
+
+/*
+ * Serve I/O from a userspace daemon instead of the in-kernel
+ * store, see bdev_ring.h. The ring has one slot per tag, so this
+ * uses a single hardware queue of at most BDEV_RING_MAX_DEPTH.
+ */
+static bool userspace = false;
+module_param(userspace, bool, S_IRUGO);
+MODULE_PARM_DESC(userspace, "Forward requests to a userspace daemon through /dev/<disk>-ctl (default: off)");
+
+/*
+ * Lifecycle messages (open/release) are only printed when
+ * debug is set. Per-request events go through the bdev
+ * tracepoints instead, see bdev_trace.h.
+ */
+static bool debug = false;
+module_param(debug, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(debug, "Log device lifecycle messages");
+
+#define bdev_dbg(fmt, ...) \
+	do { if(debug) printk(KERN_INFO "bdev: " fmt, ##__VA_ARGS__); } while(0)
+
+/*
+ * Each page of a device is represented by a slot, which holds
+ * either a plain page or, with compression on, a zsmalloc handle
+ * to the compressed data. Slots are created on first write and
+ * stay put until the page is discarded, so their contents can be
+ * swapped under the slot lock without readers ever seeing the
+ * slot itself go away. zram does the same with its table entries.
+ */
+enum bdev_slot_bits {
+	BDEV_SLOT_LOCK,					// Protects the slot contents
+	BDEV_SLOT_COMPRESSED,			// handle holds len compressed bytes
+	BDEV_SLOT_SAME,					// Page is pattern repeated
+	BDEV_SLOT_DIRTY,				// Write cache page not yet in the store
+};
+
+struct bdev_slot {
+	unsigned long flags;
+	union {
+		struct page *page;
+		unsigned long handle;
+		unsigned long pattern;
+	};
+	unsigned int len;
+};
+
+/*
+ * Backing store for a device. Slots live in an xarray keyed by
+ * their page offset into the device and are only allocated the
+ * first time they are written, the same way brd does it. Memory
+ * use therefore follows the working set, and holes read back as
+ * zeros.
+ *
+ * Snapshots stack stores on top of each other. Taking one freezes
+ * the device's store and gives the device and the snapshot a new,
+ * empty store each with the frozen one as parent. Frozen stores
+ * are never written again and are shared by reference count, so
+ * their pages are shared by every device above them. Pages are
+ * copied up into the top store when they're partially overwritten,
+ * and discarded pages that still exist below get a zero-filled
+ * whiteout slot.
+ */
+struct bdev_store {
+	struct xarray slots;
+	struct bdev_store *parent;		// Frozen store underneath, if any
+	refcount_t ref;					// Devices and stores using this one
+	atomic64_t pages_stored;		// Slots holding data
+	atomic64_t compr_bytes;			// Compressed bytes in the pool
+	atomic64_t huge_pages;			// Incompressible pages kept raw
+	atomic64_t same_pages;			// Pages kept as a pattern
+	atomic_long_t *node_pages;		// Raw pages per NUMA node
+};
+
+/*
+ * Volatile write cache. Staged pages are kept in a store of their
+ * own, always raw, until the writeback worker copies them into the
+ * device's real store.
+ */
+struct bdev_cache {
+	struct bdev_store store;		// Only slots and pages_stored are used
+	unsigned long max_pages;		// 0 when the cache is off
+	struct mutex wb_lock;			// Serializes writebacks
+	struct work_struct work;
+};
+
+// Per-CPU compression stream
+struct bdev_zstrm {
+	struct crypto_comp *tfm;
+	u8 *buffer;						// Compressed output, 2 pages
+	u8 *page;						// Scratch page for read-modify-write
+};
+
+/*
+ * Per-device I/O statistics. Every CPU updates its own copy so
+ * that accounting doesn't bounce a shared cache line between the
+ * hardware queues; readers add the copies up. Service times are
+ * kept in log2 buckets of nanoseconds, per op type.
+ */
+enum bdev_stat_op {
+	BDEV_STAT_READ,
+	BDEV_STAT_WRITE,
+	BDEV_STAT_DISCARD,
+	BDEV_STAT_FLUSH,
+	BDEV_STAT_OTHER,
+	BDEV_STAT_POLL_READ,			// Reads and writes on poll queues,
+	BDEV_STAT_POLL_WRITE,			// kept apart to compare latencies
+	BDEV_STAT_NR,
+};
+
+#define BDEV_LAT_BUCKETS 32
+
+struct bdev_stats {
+	u64 ios[BDEV_STAT_NR];
+	u64 bytes[BDEV_STAT_NR];
+	u64 errors;
+	long inflight;					// Per-CPU share, may be negative
+	u64 lat[BDEV_STAT_NR][BDEV_LAT_BUCKETS];
+	u64 comp_ns;					// Time spent compressing...
+	u64 decomp_ns;					// ...and decompressing
+	u64 csum_ns;					// ...and checksumming
+};
+
+/*
+ * Zone state, kept small since there is one per zone. wp is
+ * relative to the start of the zone, in sectors.
+ */
+struct bdev_zone {
+	spinlock_t lock;
+	struct rw_semaphore io_sem;		// Shared by writes, exclusive for reset/finish
+	u32 wp;
+	u8 type;						// BLK_ZONE_TYPE_*
+	u8 cond;						// BLK_ZONE_COND_*
+};
+
+// Per-request driver data (tag_set.cmd_size)
+struct bdev_cmd {
+	u64 start_ns;					// When ->queue_rq picked it up
+	struct request *rq;
+	blk_status_t status;			// Handed over to the completion path
+	struct hrtimer timer;			// For irqmode=2
+	struct list_head poll_list;		// Waiting for ->poll
+};
+
+/*
+ * Range locks. The device is split into chunks of 2^BDEV_STRIPE_SHIFT
+ * pages and each chunk maps onto one of BDEV_STRIPES rw_semaphores,
+ * so I/O to different parts of the device takes different locks on
+ * different cache lines. Reads and writes take their stripes shared
+ * and rely on the slot lock to keep each page consistent, so
+ * overlapping writes are ordered page by page. Anything that frees
+ * pages takes the stripes of its range exclusive, as do writes with
+ * integrity on, whose checksums have to match the data that ends up
+ * stored. Stripes are always taken in ascending order.
+ */
+#define BDEV_STRIPES		64
+#define BDEV_STRIPE_SHIFT	4
+
+struct bdev_stripe {
+	struct rw_semaphore sem;
+} ____cacheline_aligned_in_smp;
+
+/*
+ * A device's backing_file. Pages are read in a stripe chunk at a
+ * time, which is the readahead window. Each chunk has a lock bit,
+ * held while the chunk is read in and while a page of it that's
+ * still in the file is overwritten whole, so a fault can't replace
+ * newer data with the file's. Faults in different chunks run in
+ * parallel.
+ */
+#define BDEV_FILE_RA_PAGES	(1 << BDEV_STRIPE_SHIFT)
+
+struct bdev_file {
+	struct file *file;
+	pgoff_t nr_pages;
+	unsigned long *loaded;			// Pages no longer read from the file
+	unsigned long *dirty;			// Pages changed since the last writeback
+	unsigned long *chunk_locks;		// One bit per readahead chunk
+	struct mutex wb_lock;			// Serializes writebacks
+};
+
+// Userspace-served mode, see bdev_ring.h
+struct bdev_ring {
+	struct miscdevice misc;			// /dev/<disk>-ctl
+	char name[DISK_NAME_LEN + 4];
+	struct bdev *dev;
+	void *mem;						// Shared with the daemon
+	struct bdev_ring_hdr *hdr;
+	struct bdev_ring_sqe *sqes;
+	struct bdev_ring_cqe *cqes;
+	u8 *bufs;
+	unsigned int depth;
+	spinlock_t sq_lock;				// Protects sq_tail and attached
+	u32 sq_tail;					// Our copies of the indices we own;
+	u32 cq_head;					// the shared ones are only written
+	bool attached;					// A daemon has the ring open
+	struct mutex cq_lock;			// Serializes reaping
+	wait_queue_head_t wait;			// Daemon waits here for submissions
+	DECLARE_BITMAP(inflight, BDEV_RING_MAX_DEPTH);	// Tags the daemon owes us
+};
+
+// Per-hctx list of requests done on a poll queue
+struct bdev_pollq {
+	spinlock_t lock;
+	struct list_head list;
+};
+
+struct bdev {
+	u64 size;						// Device size (in bytes), changes under all stripes
+	struct mutex resize_lock;		// Serializes resizes
+	struct bdev_store *store;		// Sparse page store, swapped under all stripes
+	struct bdev_cache cache;		// Volatile write cache
+	struct bdev_stripe stripes[BDEV_STRIPES];	// Range locks for the store
+	u32 *csums;						// Per-sector crc32c, changes under all stripes
+	atomic64_t csum_errors;			// Reads that failed verification
+	short users;					// Number of users
+	short media_change;				// Flag for media changed
+	spinlock_t lock;				// For mutual exclusion
+	struct blk_mq_tag_set tag_set;	// Own tag set, unused with shared_tags
+	struct blk_mq_tag_set *set;		// Tag set the queue was made from
+	struct request_queue *queue;	// Device request queue
+	struct gendisk *gd;
+	struct timer_list timer;		// For simulated media changes
+	struct bdev_stats __percpu *stats;
+	struct dentry *debugfs_dir;
+	atomic_long_t bw_budget;		// Bytes that can still go, may be negative (mbps)
+	struct hrtimer bw_timer;
+	int node;						// Home NUMA node
+	struct bdev *origin;			// Device this is a snapshot of
+	struct bdev_ring *ring;			// Userspace-served mode only
+	struct bdev_file *file;			// backing_file, if any
+	struct bdev_zone *zones;		// Zone array, NULL unless zoned
+	unsigned int nr_zones;
+	unsigned int zone_shift;		// log2 of the zone size in sectors
+	spinlock_t zone_res_lock;		// Protects the two counts below
+	unsigned int nr_zones_open;
+	unsigned int nr_zones_active;
+};
+
+static struct bdev **devices = NULL;	// NULL until the device is first set up
+static int nr_devices = 0;				// Entries of devices in use
+static DEFINE_MUTEX(bdev_devices_lock);	// Protects the two above past init
+static struct blk_mq_tag_set bdev_shared_set;	// With shared_tags
+static struct dentry *bdev_debugfs_root = NULL;
+static struct kmem_cache *bdev_slot_cache = NULL;
+static struct zs_pool *bdev_zpool = NULL;
+static struct bdev_zstrm __percpu *bdev_zstrms = NULL;
+static struct crypto_shash *bdev_csum_tfm = NULL;
+static u32 bdev_zero_csum;				// Checksum of a sector of zeros
+
+static const char *bdev_stat_names[BDEV_STAT_NR] = {
+	[BDEV_STAT_READ]	= "read",
+	[BDEV_STAT_WRITE]	= "write",
+	[BDEV_STAT_DISCARD]	= "discard",
+	[BDEV_STAT_FLUSH]	= "flush",
+	[BDEV_STAT_OTHER]	= "other",
+	[BDEV_STAT_POLL_READ]	= "poll_read",
+	[BDEV_STAT_POLL_WRITE]	= "poll_write",
+};
+
+static enum bdev_stat_op bdev_stat_op(struct request *req)
+{
+	bool polled = req->mq_hctx->type == HCTX_TYPE_POLL;
+
+	switch(req_op(req)) {
+	case REQ_OP_READ:
+		return polled ? BDEV_STAT_POLL_READ : BDEV_STAT_READ;
+	case REQ_OP_WRITE:
+	case REQ_OP_ZONE_APPEND:
+		return polled ? BDEV_STAT_POLL_WRITE : BDEV_STAT_WRITE;
+	case REQ_OP_DISCARD:
+	case REQ_OP_WRITE_ZEROES:
+		return BDEV_STAT_DISCARD;
+	case REQ_OP_FLUSH:
+		return BDEV_STAT_FLUSH;
+	default:
+		return BDEV_STAT_OTHER;
+	}
+}
+
+static void bdev_stats_start(struct bdev *dev, struct request *req)
+{
+	struct bdev_cmd *cmd = blk_mq_rq_to_pdu(req);
+
+	cmd->start_ns = ktime_get_ns();
+	this_cpu_inc(dev->stats->inflight);
+}
+
+/*
+ * Accounts a finished request. This may run on a different CPU
+ * from bdev_stats_start(), which is fine since only the sum of
+ * the per-CPU inflight values means anything.
+ */
+static void bdev_stats_end(struct bdev *dev, struct request *req, blk_status_t status)
+{
+	struct bdev_cmd *cmd = blk_mq_rq_to_pdu(req);
+	enum bdev_stat_op op = bdev_stat_op(req);
+	u64 ns = ktime_get_ns() - cmd->start_ns;
+	unsigned int bucket = ns ? min_t(unsigned int, ilog2(ns), BDEV_LAT_BUCKETS - 1) : 0;
+
+	this_cpu_dec(dev->stats->inflight);
+	this_cpu_inc(dev->stats->ios[op]);
+	this_cpu_add(dev->stats->bytes[op], blk_rq_bytes(req));
+	this_cpu_inc(dev->stats->lat[op][bucket]);
+	if(status != BLK_STS_OK)
+		this_cpu_inc(dev->stats->errors);
+}
+
+/*
+ * Common completion path: accounting, tracing and handing
+ * the request back to the block layer.
+ */
+static void bdev_end_request(struct bdev *dev, struct request *req, blk_status_t status)
+{
+	bdev_stats_end(dev, req, status);
+	trace_bdev_complete(req, status);
+	blk_mq_end_request(req, status);
+}
+
+static struct bdev_slot *bdev_lookup_slot(struct bdev_store *store, pgoff_t idx)
+{
+	return xa_load(&store->slots, idx);
+}
+
+/*
+ * Returns the slot at idx, creating an empty one if nothing has
+ * been written there yet. Two writers can race to fill the same
+ * hole, so the insert only succeeds if the index is still empty
+ * and the loser frees its slot and uses the winner's.
+ */
+static struct bdev_slot *bdev_get_slot(struct bdev_store *store, pgoff_t idx)
+{
+	struct bdev_slot *slot, *cur;
+
+	slot = bdev_lookup_slot(store, idx);
+	if(slot)
+		return slot;
+
+	slot = kmem_cache_zalloc(bdev_slot_cache, GFP_NOIO);
+	if(!slot)
+		return NULL;
+
+	cur = xa_cmpxchg(&store->slots, idx, NULL, slot, GFP_NOIO);
+	if(cur) {
+		kmem_cache_free(bdev_slot_cache, slot);
+		if(xa_is_err(cur))
+			return NULL;
+		slot = cur;
+	}
+
+	return slot;
+}
+
+static inline void bdev_slot_lock(struct bdev_slot *slot)
+{
+	bit_spin_lock(BDEV_SLOT_LOCK, &slot->flags);
+}
+
+static inline void bdev_slot_unlock(struct bdev_slot *slot)
+{
+	bit_spin_unlock(BDEV_SLOT_LOCK, &slot->flags);
+}
+
+// Every stripe gets its own lockdep class since several are held at once
+static struct lock_class_key bdev_stripe_keys[BDEV_STRIPES];
+
+static void bdev_init_stripes(struct bdev *dev)
+{
+	unsigned int i;
+
+	for(i = 0; i < BDEV_STRIPES; i++) {
+		init_rwsem(&dev->stripes[i].sem);
+		lockdep_set_class(&dev->stripes[i].sem, &bdev_stripe_keys[i]);
+	}
+}
+
+static inline struct rw_semaphore *bdev_page_stripe(struct bdev *dev, pgoff_t idx)
+{
+	return &dev->stripes[(idx >> BDEV_STRIPE_SHIFT) % BDEV_STRIPES].sem;
+}
+
+// Sets a bit in mask for every stripe the byte range touches
+static void bdev_range_stripes(u64 offset, u64 len, unsigned long *mask)
+{
+	u64 first = offset >> (PAGE_SHIFT + BDEV_STRIPE_SHIFT);
+	u64 last = (offset + max_t(u64, len, 1) - 1) >> (PAGE_SHIFT + BDEV_STRIPE_SHIFT);
+
+	if(last - first + 1 >= BDEV_STRIPES) {
+		bitmap_fill(mask, BDEV_STRIPES);
+		return;
+	}
+
+	bitmap_zero(mask, BDEV_STRIPES);
+	for(; first <= last; first++)
+		__set_bit(first % BDEV_STRIPES, mask);
+}
+
+static void bdev_lock_stripes(struct bdev *dev, const unsigned long *mask, bool excl)
+{
+	unsigned int i;
+
+	for_each_set_bit(i, mask, BDEV_STRIPES) {
+		if(excl)
+			down_write(&dev->stripes[i].sem);
+		else
+			down_read(&dev->stripes[i].sem);
+	}
+}
+
+static void bdev_unlock_stripes(struct bdev *dev, const unsigned long *mask, bool excl)
+{
+	unsigned int i;
+
+	for_each_set_bit(i, mask, BDEV_STRIPES) {
+		if(excl)
+			up_write(&dev->stripes[i].sem);
+		else
+			up_read(&dev->stripes[i].sem);
+	}
+}
+
+// Locks a byte range exclusively; mask is scratch space for the unlock
+static void bdev_lock_range(struct bdev *dev, u64 offset, u64 len, unsigned long *mask)
+{
+	bdev_range_stripes(offset, len, mask);
+	bdev_lock_stripes(dev, mask, true);
+}
+
+static void bdev_lock_all(struct bdev *dev, unsigned long *mask)
+{
+	bitmap_fill(mask, BDEV_STRIPES);
+	bdev_lock_stripes(dev, mask, true);
+}
+
+// True if the slot holds anything at all, which includes whiteouts
+static inline bool bdev_slot_has_data(struct bdev_slot *slot)
+{
+	if(slot->flags & (BIT(BDEV_SLOT_COMPRESSED) | BIT(BDEV_SLOT_SAME)))
+		return true;
+	return slot->page != NULL;
+}
+
+/*
+ * Finds the slot holding the data for idx, looking through the
+ * frozen stores below if the page was never written to this one.
+ * Empty slots are skipped since they only exist for a moment while
+ * a write fills them. Returns NULL for a hole.
+ */
+static struct bdev_slot *bdev_find_slot(struct bdev_store *store, pgoff_t idx)
+{
+	struct bdev_slot *slot;
+
+	for(; store; store = store->parent) {
+		slot = bdev_lookup_slot(store, idx);
+		if(slot && bdev_slot_has_data(slot))
+			return slot;
+	}
+	return NULL;
+}
+
+// True if the slot holds a plain page (as opposed to nothing, a pattern or a handle)
+static inline bool bdev_slot_has_page(struct bdev_slot *slot)
+{
+	if(slot->flags & (BIT(BDEV_SLOT_COMPRESSED) | BIT(BDEV_SLOT_SAME)))
+		return false;
+	return slot->page != NULL;
+}
+
+/*
+ * Checks whether a page consists of one repeated word, the same
+ * test zram uses. Most pages that aren't fail on the first or
+ * last word, so this is cheap for ordinary data.
+ */
+static bool bdev_page_same_filled(const void *ptr, unsigned long *pattern)
+{
+	const unsigned long *words = ptr;
+	unsigned int pos, last = PAGE_SIZE / sizeof(unsigned long) - 1;
+	unsigned long val = words[0];
+
+	if(!same_filled || val != words[last])
+		return false;
+
+	for(pos = 1; pos < last; pos++) {
+		if(words[pos] != val)
+			return false;
+	}
+
+	*pattern = val;
+	return true;
+}
+
+/*
+ * Fills len bytes of dst with what a same-filled page holds at
+ * pg_off. The word-at-a-time path covers everything a filesystem
+ * normally issues; odd offsets fall back to bytes.
+ */
+static void bdev_fill_pattern(void *dst, unsigned long pattern,
+							unsigned int pg_off, unsigned int len)
+{
+	const u8 *bytes = (const u8 *) &pattern;
+	unsigned int i;
+
+	if(!pattern) {
+		memset(dst, 0, len);
+	}
+	else if(IS_ALIGNED((unsigned long) dst | pg_off | len, sizeof(unsigned long))) {
+		memset_l(dst, pattern, len / sizeof(unsigned long));
+	}
+	else {
+		for(i = 0; i < len; i++)
+			((u8 *) dst)[i] = bytes[(pg_off + i) % sizeof(unsigned long)];
+	}
+}
+
+/*
+ * Releases whatever a slot holds and leaves it empty. The slot
+ * must be locked, or unreachable.
+ */
+static void bdev_slot_free_data(struct bdev_store *store, struct bdev_slot *slot)
+{
+	if(test_bit(BDEV_SLOT_SAME, &slot->flags)) {
+		atomic64_dec(&store->same_pages);
+		clear_bit(BDEV_SLOT_SAME, &slot->flags);
+		slot->pattern = 0;
+	}
+	else if(test_bit(BDEV_SLOT_COMPRESSED, &slot->flags)) {
+		zs_free(bdev_zpool, slot->handle);
+		atomic64_sub(slot->len, &store->compr_bytes);
+		clear_bit(BDEV_SLOT_COMPRESSED, &slot->flags);
+		slot->handle = 0;
+		slot->len = 0;
+	}
+	else if(slot->page) {
+		atomic_long_dec(&store->node_pages[page_to_nid(slot->page)]);
+		__free_page(slot->page);
+		if(compress)
+			atomic64_dec(&store->huge_pages);
+		slot->page = NULL;
+	}
+	else {
+		return;
+	}
+
+	atomic64_dec(&store->pages_stored);
+}
+
+// Puts a page into an empty slot
+static void bdev_slot_set_page(struct bdev_store *store, struct bdev_slot *slot,
+							struct page *page)
+{
+	slot->page = page;
+	atomic_long_inc(&store->node_pages[page_to_nid(page)]);
+	atomic64_inc(&store->pages_stored);
+}
+
+// Turns an empty slot into a same-filled one
+static void bdev_slot_set_same(struct bdev_store *store, struct bdev_slot *slot,
+							unsigned long pattern)
+{
+	slot->pattern = pattern;
+	set_bit(BDEV_SLOT_SAME, &slot->flags);
+	atomic64_inc(&store->same_pages);
+	atomic64_inc(&store->pages_stored);
+}
+
+static int bdev_decompress(struct bdev *dev, struct bdev_zstrm *zstrm,
+							struct bdev_slot *slot, void *dst)
+{
+	unsigned int dlen = PAGE_SIZE;
+	u64 start = ktime_get_ns();
+	void *src;
+	int ret;
+
+	src = zs_map_object(bdev_zpool, slot->handle, ZS_MM_RO);
+	ret = crypto_comp_decompress(zstrm->tfm, src, slot->len, dst, &dlen);
+	zs_unmap_object(bdev_zpool, slot->handle);
+
+	this_cpu_add(dev->stats->decomp_ns, ktime_get_ns() - start);
+
+	if(ret || dlen != PAGE_SIZE) {
+		printk_ratelimited(KERN_ERR "bdev: decompression failed (%d)\n", ret);
+		return -EIO;
+	}
+	return 0;
+}
+
+/*
+ * Copies the whole current contents of a slot into dst. The slot
+ * must be locked.
+ */
+static int bdev_slot_copy_page(struct bdev *dev, struct bdev_zstrm *zstrm,
+							struct bdev_slot *slot, void *dst)
+{
+	void *mem;
+
+	if(test_bit(BDEV_SLOT_SAME, &slot->flags)) {
+		bdev_fill_pattern(dst, slot->pattern, 0, PAGE_SIZE);
+		return 0;
+	}
+
+	if(test_bit(BDEV_SLOT_COMPRESSED, &slot->flags))
+		return bdev_decompress(dev, zstrm, slot, dst);
+
+	if(slot->page) {
+		mem = kmap_atomic(slot->page);
+		memcpy(dst, mem, PAGE_SIZE);
+		kunmap_atomic(mem);
+	}
+	else {
+		memset(dst, 0, PAGE_SIZE);
+	}
+	return 0;
+}
+
+/*
+ * Copies len bytes at pg_off out of a slot into dst. dst is
+ * already mapped and the slot lock is a spinlock, so nothing in
+ * here may sleep. The slot lock also keeps preemption off, which
+ * is what makes the per-CPU compression stream ours to use.
+ */
+static int bdev_slot_read(struct bdev *dev, struct bdev_slot *slot,
+							unsigned int pg_off, void *dst, unsigned int len)
+{
+	struct bdev_zstrm *zstrm;
+	void *mem;
+	int ret = 0;
+
+	bdev_slot_lock(slot);
+
+	if(test_bit(BDEV_SLOT_SAME, &slot->flags)) {
+		// Synthesized, there's no backing memory to copy from
+		bdev_fill_pattern(dst, slot->pattern, pg_off, len);
+	}
+	else if(test_bit(BDEV_SLOT_COMPRESSED, &slot->flags)) {
+		zstrm = this_cpu_ptr(bdev_zstrms);
+		if(len == PAGE_SIZE) {
+			ret = bdev_decompress(dev, zstrm, slot, dst);
+		}
+		else {
+			ret = bdev_decompress(dev, zstrm, slot, zstrm->page);
+			if(!ret)
+				memcpy(dst, zstrm->page + pg_off, len);
+		}
+	}
+	else if(slot->page) {
+		mem = kmap_atomic(slot->page);
+		memcpy(dst, mem + pg_off, len);
+		kunmap_atomic(mem);
+	}
+	else {
+		memset(dst, 0, len);
+	}
+
+	bdev_slot_unlock(slot);
+	return ret;
+}
+
+/*
+ * Memory a slot write may need. Writes run with the source mapped
+ * and the slot locked, so they can't sleep to allocate. When a
+ * write finds what it needs missing it fills in want_* and returns
+ * -EAGAIN; the caller drops its mappings, allocates with GFP_NOIO
+ * and tries again. Whatever wasn't used is released afterwards.
+ */
+struct bdev_prealloc {
+	int nid;						// Where page should come from
+	struct page *page;				// Zeroed page for raw storage
+	unsigned long handle;			// zsmalloc handle...
+	unsigned int handle_len;		// ...and the size it was allocated for
+	bool want_page;
+	unsigned int want_len;
+};
+
+/*
+ * Picks the node for the backing page at idx according to
+ * numa_policy. NUMA_NO_NODE lets the allocator use the local node.
+ */
+static int bdev_page_node(struct bdev *dev, pgoff_t idx)
+{
+	unsigned int n;
+	int nid;
+
+	switch(numa_policy) {
+	case BDEV_NUMA_INTERLEAVE:
+		nid = first_online_node;
+		for(n = idx % num_online_nodes(); n; n--)
+			nid = next_online_node(nid);
+		return nid;
+	case BDEV_NUMA_LOCAL:
+		return numa_node_id();
+	default:
+		return dev->node;
+	}
+}
+
+static int bdev_prealloc_fill(struct bdev_prealloc *pa)
+{
+	if(pa->want_page && !pa->page) {
+		pa->page = alloc_pages_node(pa->nid, GFP_NOIO | __GFP_ZERO | __GFP_HIGHMEM, 0);
+		if(!pa->page)
+			return -ENOMEM;
+	}
+
+	if(pa->want_len) {
+		if(pa->handle)
+			zs_free(bdev_zpool, pa->handle);
+		pa->handle = zs_malloc(bdev_zpool, pa->want_len,
+			GFP_NOIO | __GFP_HIGHMEM | __GFP_MOVABLE);
+		if(!pa->handle)
+			return -ENOMEM;
+		pa->handle_len = pa->want_len;
+	}
+
+	pa->want_page = false;
+	pa->want_len = 0;
+	return 0;
+}
+
+static void bdev_prealloc_release(struct bdev_prealloc *pa)
+{
+	if(pa->page)
+		__free_page(pa->page);
+	if(pa->handle)
+		zs_free(bdev_zpool, pa->handle);
+}
+
+static int bdev_slot_write_raw(struct bdev *dev, struct bdev_slot *slot,
+							struct bdev_slot *below, unsigned int pg_off,
+							const void *src, unsigned int len, struct bdev_prealloc *pa)
+{
+	struct bdev_store *store = dev->store;
+	unsigned long pattern;
+	void *mem;
+
+	bdev_slot_lock(slot);
+
+	// A whole page of one repeated word doesn't need a page at all
+	if(src && len == PAGE_SIZE && bdev_page_same_filled(src, &pattern)) {
+		bdev_slot_free_data(store, slot);
+		bdev_slot_set_same(store, slot, pattern);
+		goto out;
+	}
+
+	if(!bdev_slot_has_page(slot)) {
+		if(!pa->page) {
+			bdev_slot_unlock(slot);
+			pa->want_page = true;
+			return -EAGAIN;
+		}
+
+		// Part of a same-filled page is changing, so it needs real memory now
+		if(test_bit(BDEV_SLOT_SAME, &slot->flags)) {
+			mem = kmap_atomic(pa->page);
+			bdev_fill_pattern(mem, slot->pattern, 0, PAGE_SIZE);
+			kunmap_atomic(mem);
+			bdev_slot_free_data(store, slot);
+		}
+		// Part of a page in a frozen store is changing, copy the rest up
+		else if(below && len < PAGE_SIZE) {
+			mem = kmap_atomic(pa->page);
+			bdev_slot_lock(below);
+			bdev_slot_copy_page(dev, NULL, below, mem);	// Never compressed here
+			bdev_slot_unlock(below);
+			kunmap_atomic(mem);
+		}
+
+		bdev_slot_set_page(store, slot, pa->page);
+		pa->page = NULL;
+	}
+
+	mem = kmap_atomic(slot->page);
+	if(src)
+		memcpy(mem + pg_off, src, len);
+	else
+		memset(mem + pg_off, 0, len);
+	kunmap_atomic(mem);
+
+out:
+	bdev_slot_unlock(slot);
+	return 0;
+}
+
+/*
+ * Compressed writes always rebuild the whole page: a partial
+ * write decompresses the old contents first, merges the new
+ * bytes in and compresses the result. The slot stays locked
+ * throughout so concurrent partial writes to the same page
+ * can't lose each other's updates.
+ */
+static int bdev_slot_write_compressed(struct bdev *dev, struct bdev_slot *slot,
+							struct bdev_slot *below, unsigned int pg_off,
+							const void *src, unsigned int len, struct bdev_prealloc *pa)
+{
+	struct bdev_store *store = dev->store;
+	struct bdev_zstrm *zstrm;
+	unsigned int clen = 2 * PAGE_SIZE;
+	unsigned long pattern;
+	const void *page_src;
+	void *mem;
+	u64 start;
+	int ret;
+
+	bdev_slot_lock(slot);
+	zstrm = this_cpu_ptr(bdev_zstrms);
+
+	if(src && len == PAGE_SIZE) {
+		page_src = src;
+	}
+	else {
+		if(below && !bdev_slot_has_data(slot)) {
+			bdev_slot_lock(below);
+			ret = bdev_slot_copy_page(dev, zstrm, below, zstrm->page);
+			bdev_slot_unlock(below);
+		}
+		else {
+			ret = bdev_slot_copy_page(dev, zstrm, slot, zstrm->page);
+		}
+		if(ret)
+			goto out;
+		if(src)
+			memcpy(zstrm->page + pg_off, src, len);
+		else
+			memset(zstrm->page + pg_off, 0, len);
+		page_src = zstrm->page;
+	}
+
+	// Same-filled pages skip compression altogether
+	if(bdev_page_same_filled(page_src, &pattern)) {
+		bdev_slot_free_data(store, slot);
+		bdev_slot_set_same(store, slot, pattern);
+		ret = 0;
+		goto out;
+	}
+
+	start = ktime_get_ns();
+	ret = crypto_comp_compress(zstrm->tfm, page_src, PAGE_SIZE, zstrm->buffer, &clen);
+	this_cpu_add(dev->stats->comp_ns, ktime_get_ns() - start);
+	if(ret) {
+		ret = -EIO;
+		goto out;
+	}
+
+	// Not worth compressing, keep the page as it is
+	if(clen > BDEV_HUGE_SIZE) {
+		if(!pa->page) {
+			pa->want_page = true;
+			ret = -EAGAIN;
+			goto out;
+		}
+		mem = kmap_atomic(pa->page);
+		memcpy(mem, page_src, PAGE_SIZE);
+		kunmap_atomic(mem);
+
+		bdev_slot_free_data(store, slot);
+		bdev_slot_set_page(store, slot, pa->page);
+		pa->page = NULL;
+		atomic64_inc(&store->huge_pages);
+		goto out;
+	}
+
+	if(pa->handle && pa->handle_len < clen) {
+		zs_free(bdev_zpool, pa->handle);
+		pa->handle = 0;
+	}
+	if(!pa->handle) {
+		pa->handle = zs_malloc(bdev_zpool, clen,
+			GFP_NOWAIT | __GFP_NOWARN | __GFP_HIGHMEM | __GFP_MOVABLE);
+		if(!pa->handle) {
+			pa->want_len = clen;
+			ret = -EAGAIN;
+			goto out;
+		}
+		pa->handle_len = clen;
+	}
+
+	mem = zs_map_object(bdev_zpool, pa->handle, ZS_MM_WO);
+	memcpy(mem, zstrm->buffer, clen);
+	zs_unmap_object(bdev_zpool, pa->handle);
+
+	bdev_slot_free_data(store, slot);
+	slot->handle = pa->handle;
+	slot->len = clen;
+	set_bit(BDEV_SLOT_COMPRESSED, &slot->flags);
+	pa->handle = 0;
+	atomic64_add(clen, &store->compr_bytes);
+	atomic64_inc(&store->pages_stored);
+
+out:
+	bdev_slot_unlock(slot);
+	return ret;
+}
+
+/*
+ * Writes len bytes from page at off into the slot at pg_off, or
+ * zeros if page is NULL, allocating whatever memory the write
+ * turns out to need along the way. slot must belong to the
+ * device's top store.
+ */
+static int bdev_slot_write(struct bdev *dev, struct bdev_slot *slot, pgoff_t idx,
+							unsigned int pg_off, struct page *page, unsigned int off,
+							unsigned int len)
+{
+	struct bdev_prealloc pa = { .nid = bdev_page_node(dev, idx) };
+	struct bdev_slot *below = bdev_find_slot(dev->store->parent, idx);
+	void *buf;
+	int err;
+
+	for(;;) {
+		buf = page ? kmap_atomic(page) + off : NULL;
+		if(compress)
+			err = bdev_slot_write_compressed(dev, slot, below, pg_off, buf, len, &pa);
+		else
+			err = bdev_slot_write_raw(dev, slot, below, pg_off, buf, len, &pa);
+		if(buf)
+			kunmap_atomic(buf - off);
+
+		if(err != -EAGAIN)
+			break;
+
+		err = bdev_prealloc_fill(&pa);
+		if(err)
+			break;
+	}
+
+	bdev_prealloc_release(&pa);
+	return err;
+}
+
+/*
+ * Volatile write cache. With cache_size set, writes land in a
+ * staging store of raw pages and complete straight away; a worker
+ * later copies dirty pages into the real store and drops them from
+ * the cache. Reads look in the cache first so they always see the
+ * newest data. REQ_PREFLUSH and REQ_FUA are honoured by copying
+ * dirty pages into the store before the request completes.
+ */
+static struct page *bdev_cache_alloc_page(struct bdev *dev, pgoff_t idx, bool fill)
+{
+	struct bdev_slot *mslot;
+	struct page *page;
+	void *mem;
+	int err = 0;
+
+	page = alloc_pages_node(bdev_page_node(dev, idx), GFP_NOIO | __GFP_HIGHMEM, 0);
+	if(!page)
+		return NULL;
+
+	// Partial writes keep the rest of the page, so start from what the store has
+	mem = kmap_atomic(page);
+	mslot = fill ? bdev_find_slot(dev->store, idx) : NULL;
+	if(mslot)
+		err = bdev_slot_read(dev, mslot, 0, mem, PAGE_SIZE);
+	else if(fill)
+		clear_page(mem);
+	kunmap_atomic(mem);
+
+	if(err) {
+		__free_page(page);
+		return NULL;
+	}
+	return page;
+}
+
+/*
+ * Stages len bytes from page at off for the device page at idx.
+ * The store underneath only changes through writeback of a page
+ * that's already cached, or with the stripe held exclusive, so
+ * filling a new cache page from it outside the slot lock is safe.
+ * If another write caches the page first, the new one is dropped.
+ */
+static int bdev_cache_write(struct bdev *dev, pgoff_t idx, unsigned int pg_off,
+							struct page *page, unsigned int off, unsigned int len)
+{
+	struct bdev_cache *cache = &dev->cache;
+	struct page *fresh = NULL;
+	struct bdev_slot *slot;
+	void *src, *dst;
+
+	slot = bdev_get_slot(&cache->store, idx);
+	if(!slot)
+		return -ENOMEM;
+
+	bdev_slot_lock(slot);
+	while(!slot->page) {
+		if(fresh) {
+			slot->page = fresh;
+			fresh = NULL;
+			atomic64_inc(&cache->store.pages_stored);
+			break;
+		}
+
+		bdev_slot_unlock(slot);
+		fresh = bdev_cache_alloc_page(dev, idx, len != PAGE_SIZE);
+		if(!fresh)
+			return -ENOMEM;
+		bdev_slot_lock(slot);
+	}
+
+	src = kmap_atomic(page);
+	dst = kmap_atomic(slot->page);
+	memcpy(dst + pg_off, src + off, len);
+	kunmap_atomic(dst);
+	kunmap_atomic(src);
+	set_bit(BDEV_SLOT_DIRTY, &slot->flags);
+
+	bdev_slot_unlock(slot);
+
+	// Someone else filled the hole first
+	if(fresh)
+		__free_page(fresh);
+
+	if(atomic64_read(&cache->store.pages_stored) > cache->max_pages / 2)
+		queue_work(system_unbound_wq, &cache->work);
+	return 0;
+}
+
+// Returns false if the page isn't cached and has to come from the store
+static bool bdev_cache_read(struct bdev *dev, pgoff_t idx, unsigned int pg_off,
+							void *dst, unsigned int len)
+{
+	struct bdev_slot *slot;
+	bool hit = false;
+	void *mem;
+
+	slot = bdev_lookup_slot(&dev->cache.store, idx);
+	if(!slot)
+		return false;
+
+	bdev_slot_lock(slot);
+	if(slot->page) {
+		mem = kmap_atomic(slot->page);
+		memcpy(dst, mem + pg_off, len);
+		kunmap_atomic(mem);
+		hit = true;
+	}
+	bdev_slot_unlock(slot);
+
+	return hit;
+}
+
+/*
+ * Copies the dirty cache pages in [first, last] into the store.
+ * Called with wb_lock held, which serializes writebacks so that
+ * two of them can't write different versions of the same page
+ * into the store out of order. With lock_pages each page's stripe
+ * is taken shared while it's copied; otherwise the caller already
+ * holds every stripe. The pages stay cached (clean) until the
+ * next eviction.
+ */
+static int __bdev_cache_writeback(struct bdev *dev, pgoff_t first, pgoff_t last,
+							bool lock_pages)
+{
+	struct bdev_cache *cache = &dev->cache;
+	struct bdev_slot *slot, *mslot;
+	struct rw_semaphore *sem;
+	struct page *bounce;
+	unsigned long idx;
+	void *src, *dst;
+	int err = 0;
+
+	bounce = alloc_page(GFP_NOIO);
+	if(!bounce)
+		return -ENOMEM;
+
+	xa_for_each_range(&cache->store.slots, idx, slot, first, last) {
+		sem = lock_pages ? bdev_page_stripe(dev, idx) : NULL;
+		if(sem)
+			down_read(sem);
+
+		// It may have been discarded before we got the stripe
+		slot = bdev_lookup_slot(&cache->store, idx);
+		if(!slot) {
+			if(sem)
+				up_read(sem);
+			continue;
+		}
+
+		bdev_slot_lock(slot);
+		if(!test_and_clear_bit(BDEV_SLOT_DIRTY, &slot->flags)) {
+			bdev_slot_unlock(slot);
+			if(sem)
+				up_read(sem);
+			continue;
+		}
+		src = kmap_atomic(slot->page);
+		dst = kmap_atomic(bounce);
+		copy_page(dst, src);
+		kunmap_atomic(dst);
+		kunmap_atomic(src);
+		bdev_slot_unlock(slot);
+
+		mslot = bdev_get_slot(dev->store, idx);
+		err = mslot ? bdev_slot_write(dev, mslot, idx, 0, bounce, 0, PAGE_SIZE) : -ENOMEM;
+		if(err)
+			set_bit(BDEV_SLOT_DIRTY, &slot->flags);
+		if(sem)
+			up_read(sem);
+		if(err)
+			break;
+	}
+
+	__free_page(bounce);
+	return err;
+}
+
+// Writeback for callers that hold no stripes
+static int bdev_cache_writeback(struct bdev *dev, pgoff_t first, pgoff_t last)
+{
+	int err;
+
+	mutex_lock(&dev->cache.wb_lock);
+	err = __bdev_cache_writeback(dev, first, last, true);
+	mutex_unlock(&dev->cache.wb_lock);
+	return err;
+}
+
+static void bdev_cache_free_slot(struct bdev_cache *cache, struct bdev_slot *slot)
+{
+	if(slot->page) {
+		__free_page(slot->page);
+		atomic64_dec(&cache->store.pages_stored);
+	}
+	kmem_cache_free(bdev_slot_cache, slot);
+}
+
+// Drops every clean page from the cache
+static void bdev_cache_evict(struct bdev *dev)
+{
+	struct bdev_cache *cache = &dev->cache;
+	DECLARE_BITMAP(stripes, BDEV_STRIPES);
+	struct bdev_slot *slot;
+	unsigned long idx;
+
+	bdev_lock_all(dev, stripes);
+	xa_for_each(&cache->store.slots, idx, slot) {
+		if(test_bit(BDEV_SLOT_DIRTY, &slot->flags))
+			continue;
+		xa_erase(&cache->store.slots, idx);
+		bdev_cache_free_slot(cache, slot);
+	}
+	bdev_unlock_stripes(dev, stripes, true);
+}
+
+/*
+ * Drops cached data for a byte range that's being discarded.
+ * Called with the range locked exclusive.
+ */
+static void bdev_cache_discard(struct bdev *dev, u64 offset, u64 len)
+{
+	struct bdev_cache *cache = &dev->cache;
+	struct bdev_slot *slot;
+	unsigned long idx;
+	u64 start, end;
+	void *mem;
+
+	if(!len)
+		return;
+
+	xa_for_each_range(&cache->store.slots, idx, slot, offset >> PAGE_SHIFT,
+							(offset + len - 1) >> PAGE_SHIFT) {
+		start = max_t(u64, offset, (u64) idx << PAGE_SHIFT);
+		end = min_t(u64, offset + len, (u64) (idx + 1) << PAGE_SHIFT);
+
+		if(end - start == PAGE_SIZE) {
+			xa_erase(&cache->store.slots, idx);
+			bdev_cache_free_slot(cache, slot);
+		}
+		else if(slot->page) {
+			mem = kmap_atomic(slot->page);
+			memset(mem + (start & ~PAGE_MASK), 0, end - start);
+			kunmap_atomic(mem);
+		}
+	}
+}
+
+static void bdev_cache_work(struct work_struct *work)
+{
+	struct bdev *dev = container_of(work, struct bdev, cache.work);
+	int err;
+
+	err = bdev_cache_writeback(dev, 0, ULONG_MAX);
+	if(err)
+		printk_ratelimited(KERN_ERR "bdev: cache writeback failed (%d)\n", err);
+
+	bdev_cache_evict(dev);
+
+	// Writes may have been held back while the cache was full
+	blk_mq_start_stopped_hw_queues(dev->queue, true);
+}
+
+/*
+ * Holds writes back while the cache is full, the same way
+ * bdev_throttled() does for the bandwidth cap. The writeback
+ * worker restarts the queues once it has made room.
+ */
+static bool bdev_cache_full(struct bdev *dev, struct request *req)
+{
+	struct bdev_cache *cache = &dev->cache;
+
+	// Discard and write zeroes don't go through the cache
+	if(!cache->max_pages ||
+			(req_op(req) != REQ_OP_WRITE && req_op(req) != REQ_OP_ZONE_APPEND))
+		return false;
+
+	if(atomic64_read(&cache->store.pages_stored) < cache->max_pages)
+		return false;
+
+	blk_mq_stop_hw_queues(dev->queue);
+	queue_work(system_unbound_wq, &cache->work);
+
+	// The worker may have finished before the queues stopped
+	if(atomic64_read(&cache->store.pages_stored) < cache->max_pages)
+		blk_mq_start_stopped_hw_queues(dev->queue, true);
+
+	return true;
+}
+
+static blk_status_t bdev_cache_flush(struct bdev *dev)
+{
+	int err;
+
+	if(!dev->cache.max_pages)
+		return BLK_STS_OK;
+
+	err = bdev_cache_writeback(dev, 0, ULONG_MAX);
+
+	// Everything is clean now; let the worker give the memory back
+	queue_work(system_unbound_wq, &dev->cache.work);
+	return errno_to_blk_status(err);
+}
+
+static void bdev_init_cache(struct bdev *dev)
+{
+	struct bdev_cache *cache = &dev->cache;
+
+	xa_init(&cache->store.slots);
+	mutex_init(&cache->wb_lock);
+	INIT_WORK(&cache->work, bdev_cache_work);
+	cache->max_pages = (unsigned long) cache_size << (20 - PAGE_SHIFT);
+}
+
+static void bdev_free_cache(struct bdev *dev)
+{
+	struct bdev_cache *cache = &dev->cache;
+	struct bdev_slot *slot;
+	unsigned long idx;
+
+	xa_for_each(&cache->store.slots, idx, slot)
+		bdev_cache_free_slot(cache, slot);
+	xa_destroy(&cache->store.slots);
+}
+
+static u32 bdev_csum(const void *buf)
+{
+	SHASH_DESC_ON_STACK(desc, bdev_csum_tfm);
+	u32 crc;
+
+	desc->tfm = bdev_csum_tfm;
+	crypto_shash_digest(desc, buf, KERNEL_SECTOR_SIZE, (u8 *) &crc);
+	return crc;
+}
+
+/*
+ * Backing file support. A page's loaded bit is set once the store,
+ * rather than the file, holds its contents; pages that are all zeros
+ * in the file are marked loaded without being stored.
+ */
+static inline bool bdev_file_loaded(struct bdev_file *bf, pgoff_t idx)
+{
+	bool loaded = test_bit(idx, bf->loaded);
+
+	smp_rmb();		// Pairs with smp_mb__before_atomic() in bdev_file_fault()
+	return loaded;
+}
+
+static void bdev_file_lock_chunk(struct bdev_file *bf, pgoff_t idx)
+{
+	wait_on_bit_lock_io(bf->chunk_locks, idx / BDEV_FILE_RA_PAGES, TASK_UNINTERRUPTIBLE);
+}
+
+static void bdev_file_unlock_chunk(struct bdev_file *bf, pgoff_t idx)
+{
+	clear_and_wake_up_bit(idx / BDEV_FILE_RA_PAGES, bf->chunk_locks);
+}
+
+/*
+ * Reads the stripe chunk around idx in from the file and puts the
+ * pages that haven't been loaded yet into the store. The caller
+ * holds idx's stripe and its chunk lock. The file is read with
+ * memory reclaim kept from issuing I/O, since reclaim could end
+ * up waiting on this very device.
+ */
+static int bdev_file_fault(struct bdev *dev, pgoff_t idx)
+{
+	struct bdev_file *bf = dev->file;
+	pgoff_t first = round_down(idx, BDEV_FILE_RA_PAGES);
+	unsigned int nr = min_t(pgoff_t, BDEV_FILE_RA_PAGES, bf->nr_pages - first);
+	struct page *pages[BDEV_FILE_RA_PAGES] = { NULL };
+	struct bio_vec bvecs[BDEV_FILE_RA_PAGES];
+	loff_t pos = (loff_t) first << PAGE_SHIFT;
+	struct bdev_slot *slot;
+	struct iov_iter iter;
+	size_t done = 0, valid;
+	unsigned int i, j, noio;
+	sector_t sector;
+	ssize_t ret;
+	void *mem;
+	int err = 0;
+
+	if(test_bit(idx, bf->loaded))
+		return 0;
+
+	noio = memalloc_noio_save();
+
+	for(i = 0; i < nr; i++) {
+		pages[i] = alloc_page(GFP_NOIO);
+		if(!pages[i]) {
+			err = -ENOMEM;
+			goto out;
+		}
+		bvecs[i].bv_page = pages[i];
+		bvecs[i].bv_offset = 0;
+		bvecs[i].bv_len = PAGE_SIZE;
+	}
+	iov_iter_bvec(&iter, READ, bvecs, nr, (size_t) nr << PAGE_SHIFT);
+
+	while(iov_iter_count(&iter)) {
+		ret = vfs_iter_read(bf->file, &iter, &pos, 0);
+		if(ret < 0) {
+			err = ret;
+			goto out;
+		}
+		if(!ret)
+			break;
+		done += ret;
+	}
+
+	for(i = 0; i < nr; i++) {
+		mem = page_address(pages[i]);
+
+		// Past the end of the file reads back as zeros
+		valid = clamp_t(ssize_t, (ssize_t) done - (ssize_t) i * PAGE_SIZE, 0, PAGE_SIZE);
+		if(valid < PAGE_SIZE)
+			memset(mem + valid, 0, PAGE_SIZE - valid);
+
+		if(test_bit(first + i, bf->loaded))
+			continue;
+
+		// Checksums for pages still in the file are filled in here
+		if(dev->csums) {
+			sector = (sector_t) (first + i) << (PAGE_SHIFT - SECTOR_SHIFT);
+			for(j = 0; j < PAGE_SECTORS && sector + j < (dev->size >> SECTOR_SHIFT); j++)
+				dev->csums[sector + j] = bdev_csum(mem + j * KERNEL_SECTOR_SIZE);
+		}
+
+		if(memchr_inv(mem, 0, PAGE_SIZE)) {
+			slot = bdev_get_slot(dev->store, first + i);
+			if(!slot) {
+				err = -ENOMEM;
+				break;
+			}
+			err = bdev_slot_write(dev, slot, first + i, 0, pages[i], 0, PAGE_SIZE);
+			if(err)
+				break;
+		}
+		smp_mb__before_atomic();
+		set_bit(first + i, bf->loaded);
+	}
+
+out:
+	memalloc_noio_restore(noio);
+	for(i = 0; i < nr; i++) {
+		if(pages[i])
+			__free_page(pages[i]);
+	}
+	if(err)
+		printk_ratelimited(KERN_ERR "bdev: reading %pD failed (%d)\n", bf->file, err);
+	return err;
+}
+
+/*
+ * Called before idx is read or written. Brings the page in from
+ * the file unless it's about to be overwritten whole. In that case
+ * it returns 1 with the chunk still locked, and the caller unlocks
+ * it once the write is done and the page is marked dirty.
+ */
+static int bdev_file_prepare(struct bdev *dev, pgoff_t idx, unsigned int len, bool write)
+{
+	struct bdev_file *bf = dev->file;
+	int err;
+
+	if(bdev_file_loaded(bf, idx))
+		return 0;
+
+	bdev_file_lock_chunk(bf, idx);
+	if(write && len == PAGE_SIZE) {
+		if(!test_bit(idx, bf->loaded))
+			return 1;
+		err = 0;
+	}
+	else {
+		err = bdev_file_fault(dev, idx);
+	}
+	bdev_file_unlock_chunk(bf, idx);
+	return err;
+}
+
+// Called once pages have been written
+static void bdev_file_dirty(struct bdev *dev, pgoff_t first, pgoff_t last)
+{
+	pgoff_t idx;
+
+	smp_mb__before_atomic();		// Pairs with smp_rmb() in bdev_file_loaded()
+	for(idx = first; idx <= last; idx++) {
+		set_bit(idx, dev->file->loaded);
+		set_bit(idx, dev->file->dirty);
+	}
+}
+
+/*
+ * Called before a byte range is discarded. Partial pages at either
+ * end keep some of their contents, so those are brought in first.
+ */
+static int bdev_file_discard(struct bdev *dev, u64 offset, u64 len)
+{
+	int err = 0;
+
+	if(offset & ~PAGE_MASK)
+		err = bdev_file_prepare(dev, offset >> PAGE_SHIFT, 0, true);
+	if(!err && ((offset + len) & ~PAGE_MASK))
+		err = bdev_file_prepare(dev, (offset + len) >> PAGE_SHIFT, 0, true);
+	if(!err)
+		bdev_file_dirty(dev, offset >> PAGE_SHIFT, (offset + len - 1) >> PAGE_SHIFT);
+	return err;
+}
+
+static void bdev_file_free(struct bdev *dev)
+{
+	struct bdev_file *bf = dev->file;
+
+	if(!bf)
+		return;
+
+	kvfree(bf->chunk_locks);
+	kvfree(bf->loaded);
+	kvfree(bf->dirty);
+	fput(bf->file);
+	kfree(bf);
+	dev->file = NULL;
+}
+
+/*
+ * Opens the image for a device and sizes the device to it. Nothing
+ * is read here, so this takes the same time whatever the image size.
+ */
+static int bdev_file_open(struct bdev *dev, const char *path)
+{
+	struct bdev_file *bf;
+	loff_t size;
+
+	bf = kzalloc(sizeof(struct bdev_file), GFP_KERNEL);
+	if(!bf)
+		return -ENOMEM;
+	dev->file = bf;
+	mutex_init(&bf->wb_lock);
+
+	bf->file = filp_open(path, O_RDWR | O_LARGEFILE, 0);
+	if(IS_ERR(bf->file)) {
+		int err = PTR_ERR(bf->file);
+
+		kfree(bf);
+		dev->file = NULL;
+		return err;
+	}
+
+	if(!S_ISREG(file_inode(bf->file)->i_mode)) {
+		bdev_file_free(dev);
+		return -EINVAL;
+	}
+
+	// An empty file takes on the size asked for
+	size = i_size_read(file_inode(bf->file));
+	if(size)
+		dev->size = round_up(size, dev_sector_size);
+
+	bf->nr_pages = DIV_ROUND_UP(dev->size, PAGE_SIZE);
+	bf->loaded = kvcalloc(BITS_TO_LONGS(bf->nr_pages), sizeof(long), GFP_KERNEL);
+	bf->dirty = kvcalloc(BITS_TO_LONGS(bf->nr_pages), sizeof(long), GFP_KERNEL);
+	bf->chunk_locks = kvcalloc(BITS_TO_LONGS(DIV_ROUND_UP(bf->nr_pages, BDEV_FILE_RA_PAGES)),
+		sizeof(long), GFP_KERNEL);
+	if(!bf->loaded || !bf->dirty || !bf->chunk_locks)
+		goto fail;
+
+	return 0;
+
+fail:
+	bdev_file_free(dev);
+	return -ENOMEM;
+}
+
+// The range now reads back as zeros
+static void bdev_csum_clear(struct bdev *dev, u64 offset, u64 len)
+{
+	if(dev->csums)
+		memset32(dev->csums + (offset >> SECTOR_SHIFT), bdev_zero_csum,
+			len >> SECTOR_SHIFT);
+}
+
+/*
+ * Drops the backing pages for a byte range. Pages that are fully
+ * covered are removed from the store and freed, which is what
+ * gives memory back on discard; only the partial pages at either
+ * end of the range need to be zeroed in place. The caller holds
+ * the range locked exclusive.
+ */
+static int bdev_discard_range(struct bdev *dev, u64 offset, u64 len)
+{
+	struct bdev_store *store = dev->store, *below;
+	pgoff_t first, last, idx;
+	unsigned int pg_off, chunk;
+	struct bdev_slot *slot;
+	int err;
+
+	if(dev->cache.max_pages)
+		bdev_cache_discard(dev, offset, len);
+	if(dev->file && len) {
+		err = bdev_file_discard(dev, offset, len);
+		if(err)
+			return err;
+	}
+
+	// After the file fault, which fills in checksums for the whole chunk
+	bdev_csum_clear(dev, offset, len);
+
+	// Leading partial page
+	pg_off = offset & ~PAGE_MASK;
+	if(pg_off && len) {
+		chunk = min_t(u64, len, PAGE_SIZE - pg_off);
+		idx = offset >> PAGE_SHIFT;
+		if(bdev_find_slot(store, idx)) {
+			slot = bdev_get_slot(store, idx);
+			if(!slot)
+				return -ENOMEM;
+			err = bdev_slot_write(dev, slot, idx, pg_off, NULL, 0, chunk);
+			if(err)
+				return err;
+		}
+		offset += chunk;
+		len -= chunk;
+	}
+
+	// Trailing partial page
+	chunk = len & ~PAGE_MASK;
+	if(chunk) {
+		idx = (offset + len) >> PAGE_SHIFT;
+		if(bdev_find_slot(store, idx)) {
+			slot = bdev_get_slot(store, idx);
+			if(!slot)
+				return -ENOMEM;
+			err = bdev_slot_write(dev, slot, idx, 0, NULL, 0, chunk);
+			if(err)
+				return err;
+		}
+		len -= chunk;
+	}
+
+	if(!len)
+		return 0;
+
+	// Whole pages in between, only visiting the ones that exist
+	first = offset >> PAGE_SHIFT;
+	last = first + (len >> PAGE_SHIFT) - 1;
+	xa_for_each_range(&store->slots, idx, slot, first, last) {
+		xa_erase(&store->slots, idx);
+		bdev_slot_free_data(store, slot);
+		kmem_cache_free(bdev_slot_cache, slot);
+	}
+
+	// Pages in frozen stores are shared and can only be hidden
+	for(below = store->parent; below; below = below->parent) {
+		xa_for_each_range(&below->slots, idx, slot, first, last) {
+			if(!bdev_slot_has_data(slot))
+				continue;
+			slot = bdev_get_slot(store, idx);
+			if(!slot)
+				return -ENOMEM;
+			bdev_slot_lock(slot);
+			bdev_slot_free_data(store, slot);
+			bdev_slot_set_same(store, slot, 0);
+			bdev_slot_unlock(slot);
+		}
+	}
+
+	return 0;
+}
+
+static int bdev_init_store(struct bdev_store *store)
+{
+	xa_init(&store->slots);
+	store->node_pages = kcalloc(nr_node_ids, sizeof(atomic_long_t), GFP_KERNEL);
+	if(!store->node_pages)
+		return -ENOMEM;
+	return 0;
+}
+
+static void bdev_free_store(struct bdev_store *store)
+{
+	struct bdev_slot *slot;
+	unsigned long idx;
+
+	xa_for_each(&store->slots, idx, slot) {
+		bdev_slot_free_data(store, slot);
+		kmem_cache_free(bdev_slot_cache, slot);
+	}
+	xa_destroy(&store->slots);
+	kfree(store->node_pages);
+	store->node_pages = NULL;
+}
+
+static struct bdev_store *bdev_alloc_store(void)
+{
+	struct bdev_store *store;
+
+	store = kzalloc(sizeof(struct bdev_store), GFP_KERNEL);
+	if(!store)
+		return NULL;
+
+	if(bdev_init_store(store)) {
+		kfree(store);
+		return NULL;
+	}
+	refcount_set(&store->ref, 1);
+	return store;
+}
+
+// Drops a reference, freeing the store and any parents nobody else uses
+static void bdev_put_store(struct bdev_store *store)
+{
+	struct bdev_store *parent;
+
+	// A loop rather than recursion, snapshot chains can get long
+	while(store && refcount_dec_and_test(&store->ref)) {
+		parent = store->parent;
+		bdev_free_store(store);
+		kfree(store);
+		store = parent;
+	}
+}
+
+/*
+ * Copies len bytes between the device at sector and the given
+ * (possibly highmem) page. len is the length of one bvec, which
+ * may cover several backing pages if it isn't page aligned on
+ * the device side, so the copy is done a backing page at a time.
+ */
+static int bdev_transfer(struct bdev *dev, sector_t sector, unsigned int len,
+							struct page *page, unsigned int off, bool write)
+{
+	u64 offset = (u64) sector * KERNEL_SECTOR_SIZE;
+	int err = 0;
+
+	// Make sure there's room to do the write
+	if((offset + len) > dev->size) {
+		printk_ratelimited(KERN_NOTICE "bdev: beyond-end access (%lld %u)\n", offset, len);
+		return -EIO;
+	}
+
+	while(len) {
+		pgoff_t idx = offset >> PAGE_SHIFT;
+		unsigned int pg_off = offset & ~PAGE_MASK;
+		unsigned int chunk = min_t(unsigned int, len, PAGE_SIZE - pg_off);
+		struct bdev_slot *slot;
+		int locked = 0;
+		void *buf;
+
+		if(dev->file) {
+			locked = bdev_file_prepare(dev, idx, chunk, write);
+			if(locked < 0)
+				return locked;
+		}
+
+		if(write && dev->cache.max_pages) {
+			err = bdev_cache_write(dev, idx, pg_off, page, off, chunk);
+		}
+		else if(write) {
+			slot = bdev_get_slot(dev->store, idx);
+			err = slot ? bdev_slot_write(dev, slot, idx, pg_off, page, off, chunk) : -ENOMEM;
+		}
+		else {
+			buf = kmap_atomic(page);
+			if(!dev->cache.max_pages ||
+					!bdev_cache_read(dev, idx, pg_off, buf + off, chunk)) {
+				slot = bdev_find_slot(dev->store, idx);
+				if(slot)
+					err = bdev_slot_read(dev, slot, pg_off, buf + off, chunk);
+				else
+					memset(buf + off, 0, chunk);	// Never written, so it reads back as zeros
+			}
+			kunmap_atomic(buf);
+		}
+		if(write && dev->file && !err)
+			bdev_file_dirty(dev, idx, idx);
+		if(locked)
+			bdev_file_unlock_chunk(dev->file, idx);
+		if(err)
+			return err;
+
+		off += chunk;
+		offset += chunk;
+		len -= chunk;
+	}
+
+	return 0;
+}
+
+/*
+ * Checksums one bvec that has just been transferred at sector.
+ * Writes record the checksums, reads compare against them.
+ */
+static blk_status_t bdev_csum_bvec(struct bdev *dev, sector_t sector,
+								struct bio_vec *bvec, bool write)
+{
+	u64 start = ktime_get_ns();
+	blk_status_t status = BLK_STS_OK;
+	unsigned int done;
+	void *buf;
+	u32 crc;
+
+	buf = kmap_atomic(bvec->bv_page);
+	for(done = 0; done < bvec->bv_len; done += KERNEL_SECTOR_SIZE, sector++) {
+		crc = bdev_csum(buf + bvec->bv_offset + done);
+		if(write) {
+			dev->csums[sector] = crc;
+		}
+		else if(crc != dev->csums[sector]) {
+			atomic64_inc(&dev->csum_errors);
+			printk_ratelimited(KERN_WARNING "bdev: %s: checksum mismatch at sector %llu\n",
+				dev->gd->disk_name, (u64) sector);
+			status = BLK_STS_PROTECTION;
+			break;
+		}
+	}
+	kunmap_atomic(buf);
+
+	this_cpu_add(dev->stats->csum_ns, ktime_get_ns() - start);
+	return status;
+}
+
+/*
+ * Fills csums in from the device's current contents. Pages that
+ * were never written are known to be zeros and aren't read. The
+ * caller holds all stripes exclusive, or the device isn't live yet.
+ */
+static int bdev_csum_generate(struct bdev *dev, u32 *csums)
+{
+	unsigned int len, done;
+	struct page *page;
+	sector_t sector;
+	u64 offset;
+	int err = 0;
+
+	page = alloc_page(GFP_KERNEL);
+	if(!page)
+		return -ENOMEM;
+
+	for(offset = 0; offset < dev->size; offset += len) {
+		pgoff_t idx = offset >> PAGE_SHIFT;
+
+		sector = offset >> SECTOR_SHIFT;
+		len = min_t(u64, PAGE_SIZE, dev->size - offset);
+
+		// Pages still in an image get theirs when they're read in
+		if(dev->file && !bdev_file_loaded(dev->file, idx))
+			continue;
+
+		if(!bdev_find_slot(dev->store, idx) && !xa_load(&dev->cache.store.slots, idx)) {
+			memset32(csums + sector, bdev_zero_csum, len >> SECTOR_SHIFT);
+			continue;
+		}
+
+		err = bdev_transfer(dev, sector, len, page, 0, false);
+		if(err)
+			break;
+		for(done = 0; done < len; done += KERNEL_SECTOR_SIZE)
+			csums[sector++] = bdev_csum(page_address(page) + done);
+
+		cond_resched();
+	}
+
+	__free_page(page);
+	return err;
+}
+
+/*
+ * Turns checksumming on or off for one device. Turning it on
+ * checksums whatever the device already holds, with all I/O held
+ * off until that's done.
+ */
+static int bdev_integrity_set(struct bdev *dev, bool on)
+{
+	DECLARE_BITMAP(stripes, BDEV_STRIPES);
+	u32 *csums = NULL, *old;
+	int err = 0;
+
+	if(on && !bdev_csum_tfm)
+		return -EOPNOTSUPP;
+
+	// Keeps the size, and so the array length, from changing
+	mutex_lock(&dev->resize_lock);
+	if(on == !!dev->csums)
+		goto out;
+
+	if(on) {
+		csums = kvmalloc_array(dev->size >> SECTOR_SHIFT, sizeof(u32), GFP_KERNEL);
+		if(!csums) {
+			err = -ENOMEM;
+			goto out;
+		}
+	}
+
+	bdev_lock_all(dev, stripes);
+	if(csums)
+		err = bdev_csum_generate(dev, csums);
+	if(!err) {
+		old = dev->csums;
+		dev->csums = csums;
+		csums = old;
+	}
+	bdev_unlock_stripes(dev, stripes, true);
+
+out:
+	mutex_unlock(&dev->resize_lock);
+	kvfree(csums);
+	return err;
+}
+
+/*
+ * Moves the data for a read or write request. Each bvec handed out
+ * by rq_for_each_segment covers at most one page, and is transferred
+ * according to its own length rather than the request's current
+ * segment, so multi-segment requests of any size work.
+ */
+static blk_status_t bdev_do_rw(struct bdev *dev, struct request *req, sector_t pos_sector)
+{
+	struct bio_vec bvec;
+	struct req_iterator iter;
+	bool write = op_is_write(req_op(req));
+	blk_status_t status;
+	int err;
+
+	/*
+	 * This macro replaces the while loop that was needed previously:
+	 * while((req = elv_next_request(q)) != NULL) { 
+	 *    ...
+	 * }
+	 */
+	rq_for_each_segment(bvec, req, iter) {
+		trace_bdev_transfer(req, pos_sector, bvec.bv_len, write);
+
+		err = bdev_transfer(dev, pos_sector, bvec.bv_len, bvec.bv_page,
+			bvec.bv_offset, write);
+		if(err)
+			return errno_to_blk_status(err);
+
+		if(dev->csums) {
+			status = bdev_csum_bvec(dev, pos_sector, &bvec, write);
+			if(status)
+				return status;
+		}
+
+		pos_sector += bvec.bv_len >> SECTOR_SHIFT;
+	}
+
+	return BLK_STS_OK;
+}
+
+/*
+ * Handles DISCARD and WRITE_ZEROES. Both drop the backing pages for
+ * the range since a hole already reads back as zeros. Pages are
+ * being freed, so in-flight reads and writes are shut out while
+ * this runs.
+ */
+static blk_status_t bdev_do_discard(struct bdev *dev, struct request *req)
+{
+	u64 offset = (u64) blk_rq_pos(req) << SECTOR_SHIFT;
+	u64 len = blk_rq_bytes(req);
+	DECLARE_BITMAP(stripes, BDEV_STRIPES);
+	int err = -EIO;
+
+	bdev_lock_range(dev, offset, len, stripes);
+	if(offset + len <= dev->size)
+		err = bdev_discard_range(dev, offset, len);
+	bdev_unlock_stripes(dev, stripes, true);
+
+	return errno_to_blk_status(err);
+}
+
+#ifdef CONFIG_BLK_DEV_ZONED
+/*
+ * Zoned (host-managed) emulation. The first zone_nr_conv zones are
+ * conventional, the rest must be written sequentially at their
+ * write pointer or through zone append.
+ *
+ * Writes only hold the zone lock long enough to check the write
+ * pointer and move it past the data they're about to write; the
+ * copy itself happens afterwards, so appends to the same zone from
+ * different hardware queues don't wait on each other's memcpy.
+ * They hold io_sem shared from the reservation until the copy is
+ * done, which keeps a reset or finish from emptying the zone under
+ * them. io_sem is taken before any stripes.
+ */
+static inline sector_t bdev_zone_start(struct bdev *dev, unsigned int zno)
+{
+	return (sector_t) zno << dev->zone_shift;
+}
+
+static inline sector_t bdev_zone_sectors(struct bdev *dev)
+{
+	return 1ULL << dev->zone_shift;
+}
+
+/*
+ * Open/active zone accounting. Called under the zone's lock, with
+ * the zone's new condition, to move the device-wide counts along.
+ * Returns an error status if the limits don't allow it.
+ */
+static blk_status_t bdev_zone_cond_change(struct bdev *dev, struct bdev_zone *zone, u8 cond)
+{
+	bool was_open = zone->cond == BLK_ZONE_COND_IMP_OPEN ||
+		zone->cond == BLK_ZONE_COND_EXP_OPEN;
+	bool was_active = was_open || zone->cond == BLK_ZONE_COND_CLOSED;
+	bool open = cond == BLK_ZONE_COND_IMP_OPEN || cond == BLK_ZONE_COND_EXP_OPEN;
+	bool active = open || cond == BLK_ZONE_COND_CLOSED;
+	blk_status_t status = BLK_STS_OK;
+
+	spin_lock(&dev->zone_res_lock);
+
+	if(active && !was_active && zone_max_active &&
+			dev->nr_zones_active >= zone_max_active) {
+		status = BLK_STS_ZONE_ACTIVE_RESOURCE;
+		goto out;
+	}
+	if(open && !was_open && zone_max_open &&
+			dev->nr_zones_open >= zone_max_open) {
+		status = BLK_STS_ZONE_OPEN_RESOURCE;
+		goto out;
+	}
+
+	dev->nr_zones_active += (int) active - (int) was_active;
+	dev->nr_zones_open += (int) open - (int) was_open;
+	zone->cond = cond;
+
+out:
+	spin_unlock(&dev->zone_res_lock);
+	return status;
+}
+
+/*
+ * Checks a write or zone append against its zone and moves the
+ * write pointer past it. *pos is where the data goes, which for
+ * zone append is only decided here. On success a sequential zone
+ * is left with io_sem held, for bdev_zone_write_end() to release.
+ */
+static blk_status_t bdev_zone_write(struct bdev *dev, struct request *req, sector_t *pos)
+{
+	sector_t sector = blk_rq_pos(req);
+	unsigned int nr_sectors = blk_rq_sectors(req);
+	unsigned int zno = sector >> dev->zone_shift;
+	struct bdev_zone *zone;
+	blk_status_t status;
+
+	if(zno >= dev->nr_zones)
+		return BLK_STS_IOERR;
+	zone = &dev->zones[zno];
+
+	if(zone->type == BLK_ZONE_TYPE_CONVENTIONAL) {
+		if(req_op(req) == REQ_OP_ZONE_APPEND)
+			return BLK_STS_IOERR;
+		*pos = sector;
+		return BLK_STS_OK;
+	}
+
+	down_read(&zone->io_sem);
+	spin_lock(&zone->lock);
+
+	if(zone->cond == BLK_ZONE_COND_FULL) {
+		status = BLK_STS_IOERR;
+		goto out;
+	}
+
+	if(req_op(req) == REQ_OP_ZONE_APPEND)
+		sector = bdev_zone_start(dev, zno) + zone->wp;
+	else if(sector != bdev_zone_start(dev, zno) + zone->wp) {
+		status = BLK_STS_IOERR;
+		goto out;
+	}
+
+	if(zone->wp + nr_sectors > bdev_zone_sectors(dev)) {
+		status = BLK_STS_IOERR;
+		goto out;
+	}
+
+	if(zone->cond == BLK_ZONE_COND_EMPTY || zone->cond == BLK_ZONE_COND_CLOSED) {
+		status = bdev_zone_cond_change(dev, zone, BLK_ZONE_COND_IMP_OPEN);
+		if(status)
+			goto out;
+	}
+
+	zone->wp += nr_sectors;
+	if(zone->wp == bdev_zone_sectors(dev))
+		bdev_zone_cond_change(dev, zone, BLK_ZONE_COND_FULL);
+
+	// Zone append reports where the data ended up through the request
+	if(req_op(req) == REQ_OP_ZONE_APPEND)
+		req->__sector = sector;
+	*pos = sector;
+	status = BLK_STS_OK;
+
+out:
+	spin_unlock(&zone->lock);
+	if(status)
+		up_read(&zone->io_sem);
+	return status;
+}
+
+/*
+ * Called once a write reserved by bdev_zone_write() at pos is done.
+ * If the copy failed, the reservation is given back, as long as no
+ * later write has been placed after it.
+ */
+static void bdev_zone_write_end(struct bdev *dev, struct request *req, sector_t pos,
+							blk_status_t status)
+{
+	unsigned int zno = pos >> dev->zone_shift;
+	struct bdev_zone *zone = &dev->zones[zno];
+	u32 end = pos - bdev_zone_start(dev, zno) + blk_rq_sectors(req);
+
+	if(zone->type == BLK_ZONE_TYPE_CONVENTIONAL)
+		return;
+
+	if(status) {
+		spin_lock(&zone->lock);
+		if(zone->wp == end) {
+			end -= blk_rq_sectors(req);
+			if(zone->cond == BLK_ZONE_COND_FULL)
+				status = bdev_zone_cond_change(dev, zone, BLK_ZONE_COND_IMP_OPEN);
+			else if(!end && zone->cond == BLK_ZONE_COND_IMP_OPEN)
+				status = bdev_zone_cond_change(dev, zone, BLK_ZONE_COND_EMPTY);
+			else
+				status = BLK_STS_OK;
+
+			// Reopening a zone the write filled can fail on the open limits
+			if(!status)
+				zone->wp = end;
+		}
+		spin_unlock(&zone->lock);
+	}
+
+	up_read(&zone->io_sem);
+}
+
+/*
+ * Empties a sequential zone and drops its data, once writes that
+ * are still copying into it are done.
+ */
+static void bdev_zone_reset(struct bdev *dev, unsigned int zno)
+{
+	struct bdev_zone *zone = &dev->zones[zno];
+	DECLARE_BITMAP(stripes, BDEV_STRIPES);
+	u64 offset = (u64) bdev_zone_start(dev, zno) << SECTOR_SHIFT;
+	u64 len = (u64) bdev_zone_sectors(dev) << SECTOR_SHIFT;
+
+	down_write(&zone->io_sem);
+	bdev_lock_range(dev, offset, len, stripes);
+
+	spin_lock(&zone->lock);
+	bdev_zone_cond_change(dev, zone, BLK_ZONE_COND_EMPTY);
+	zone->wp = 0;
+	spin_unlock(&zone->lock);
+
+	bdev_discard_range(dev, offset, len);
+
+	bdev_unlock_stripes(dev, stripes, true);
+	up_write(&zone->io_sem);
+}
+
+static blk_status_t bdev_zone_mgmt(struct bdev *dev, struct request *req)
+{
+	unsigned int zno = blk_rq_pos(req) >> dev->zone_shift;
+	struct bdev_zone *zone;
+	blk_status_t status = BLK_STS_OK;
+
+	if(req_op(req) == REQ_OP_ZONE_RESET_ALL) {
+		for(zno = zone_nr_conv; zno < dev->nr_zones; zno++)
+			bdev_zone_reset(dev, zno);
+		return BLK_STS_OK;
+	}
+
+	if(zno >= dev->nr_zones)
+		return BLK_STS_IOERR;
+	zone = &dev->zones[zno];
+	if(zone->type == BLK_ZONE_TYPE_CONVENTIONAL)
+		return BLK_STS_IOERR;
+
+	if(req_op(req) == REQ_OP_ZONE_RESET) {
+		bdev_zone_reset(dev, zno);
+		return BLK_STS_OK;
+	}
+
+	// Finish moves the write pointer, which a failed write may want to undo
+	if(req_op(req) == REQ_OP_ZONE_FINISH)
+		down_write(&zone->io_sem);
+	spin_lock(&zone->lock);
+
+	switch(req_op(req)) {
+	case REQ_OP_ZONE_OPEN:
+		if(zone->cond == BLK_ZONE_COND_FULL)
+			status = BLK_STS_IOERR;
+		else if(zone->cond != BLK_ZONE_COND_EXP_OPEN)
+			status = bdev_zone_cond_change(dev, zone, BLK_ZONE_COND_EXP_OPEN);
+		break;
+	case REQ_OP_ZONE_CLOSE:
+		if(zone->cond == BLK_ZONE_COND_IMP_OPEN || zone->cond == BLK_ZONE_COND_EXP_OPEN)
+			bdev_zone_cond_change(dev, zone,
+				zone->wp ? BLK_ZONE_COND_CLOSED : BLK_ZONE_COND_EMPTY);
+		else if(zone->cond == BLK_ZONE_COND_FULL)
+			status = BLK_STS_IOERR;
+		break;
+	case REQ_OP_ZONE_FINISH:
+		bdev_zone_cond_change(dev, zone, BLK_ZONE_COND_FULL);
+		zone->wp = bdev_zone_sectors(dev);
+		break;
+	default:
+		status = BLK_STS_NOTSUPP;
+		break;
+	}
+
+	spin_unlock(&zone->lock);
+	if(req_op(req) == REQ_OP_ZONE_FINISH)
+		up_write(&zone->io_sem);
+	return status;
+}
+
+static int bdev_report_zones(struct gendisk *disk, sector_t sector,
+							unsigned int nr_zones, report_zones_cb cb, void *data)
+{
+	struct bdev *dev = disk->private_data;
+	unsigned int first = sector >> dev->zone_shift;
+	struct blk_zone blkz;
+	unsigned int i;
+	int error;
+
+	if(first >= dev->nr_zones)
+		return 0;
+	nr_zones = min(nr_zones, dev->nr_zones - first);
+
+	for(i = 0; i < nr_zones; i++) {
+		struct bdev_zone *zone = &dev->zones[first + i];
+
+		memset(&blkz, 0, sizeof(struct blk_zone));
+		blkz.start = bdev_zone_start(dev, first + i);
+		blkz.len = bdev_zone_sectors(dev);
+		blkz.capacity = blkz.len;
+
+		spin_lock(&zone->lock);
+		blkz.type = zone->type;
+		blkz.cond = zone->cond;
+		blkz.wp = blkz.start + zone->wp;
+		spin_unlock(&zone->lock);
+
+		error = cb(&blkz, first + i, data);
+		if(error)
+			return error;
+	}
+
+	return nr_zones;
+}
+
+/*
+ * Carves the device into zones. Capacity is rounded down to a
+ * whole number of zones.
+ */
+static int bdev_init_zones(struct bdev *dev)
+{
+	u64 zone_sects = (u64) zone_size << (20 - SECTOR_SHIFT);
+	unsigned int i;
+
+	dev->zone_shift = ilog2(zone_sects);
+	dev->nr_zones = div64_u64(dev->size >> SECTOR_SHIFT, zone_sects);
+	if(!dev->nr_zones || zone_nr_conv >= dev->nr_zones) {
+		printk(KERN_WARNING "bdev: device too small for zone_size=%d and zone_nr_conv=%d\n",
+			zone_size, zone_nr_conv);
+		return -EINVAL;
+	}
+	dev->size = (u64) dev->nr_zones * zone_sects << SECTOR_SHIFT;
+
+	dev->zones = kvcalloc(dev->nr_zones, sizeof(struct bdev_zone), GFP_KERNEL);
+	if(!dev->zones)
+		return -ENOMEM;
+
+	spin_lock_init(&dev->zone_res_lock);
+	for(i = 0; i < dev->nr_zones; i++) {
+		struct bdev_zone *zone = &dev->zones[i];
+
+		spin_lock_init(&zone->lock);
+		init_rwsem(&zone->io_sem);
+		if(i < zone_nr_conv) {
+			zone->type = BLK_ZONE_TYPE_CONVENTIONAL;
+			zone->cond = BLK_ZONE_COND_NOT_WP;
+		}
+		else {
+			zone->type = BLK_ZONE_TYPE_SEQWRITE_REQ;
+			zone->cond = BLK_ZONE_COND_EMPTY;
+		}
+	}
+
+	return 0;
+}
+
+// Queue setup that has to happen before add_disk()
+static int bdev_register_zones(struct bdev *dev)
+{
+	struct request_queue *q = dev->queue;
+	int err;
+
+	q->limits.zoned = BLK_ZONED_HM;
+	blk_queue_flag_set(QUEUE_FLAG_ZONE_RESETALL, q);
+	blk_queue_required_elevator_features(q, ELEVATOR_F_ZBD_SEQ_WRITE);
+
+	err = blk_revalidate_disk_zones(dev->gd, NULL);
+	if(err)
+		return err;
+
+	blk_queue_max_zone_append_sectors(q, bdev_zone_sectors(dev));
+	blk_queue_max_open_zones(q, zone_max_open);
+	blk_queue_max_active_zones(q, zone_max_active);
+	return 0;
+}
+#else
+static inline blk_status_t bdev_zone_write(struct bdev *dev, struct request *req, sector_t *pos)
+{
+	return BLK_STS_NOTSUPP;
+}
+
+static inline void bdev_zone_write_end(struct bdev *dev, struct request *req, sector_t pos,
+							blk_status_t status)
+{
+}
+
+static inline blk_status_t bdev_zone_mgmt(struct bdev *dev, struct request *req)
+{
+	return BLK_STS_NOTSUPP;
+}
+
+static inline int bdev_init_zones(struct bdev *dev)
+{
+	return -EOPNOTSUPP;
+}
+
+static inline int bdev_register_zones(struct bdev *dev)
+{
+	return -EOPNOTSUPP;
+}
+
+#define bdev_report_zones NULL
+#endif /* CONFIG_BLK_DEV_ZONED */
+
+static blk_status_t bdev_handle_rq(struct bdev *dev, struct request *req)
+{
+	sector_t pos = blk_rq_pos(req);
+	DECLARE_BITMAP(stripes, BDEV_STRIPES);
+	blk_status_t status;
+	bool excl;
+	int err;
+
+	switch(req_op(req)) {
+	case REQ_OP_WRITE:
+	case REQ_OP_ZONE_APPEND:
+		if(dev->zones) {
+			status = bdev_zone_write(dev, req, &pos);
+			if(status)
+				return status;
+		}
+		else if(req_op(req) == REQ_OP_ZONE_APPEND) {
+			return BLK_STS_NOTSUPP;
+		}
+		fallthrough;
+	case REQ_OP_READ:
+		excl = op_is_write(req_op(req)) && READ_ONCE(dev->csums);
+		bdev_range_stripes((u64) pos << SECTOR_SHIFT, blk_rq_bytes(req), stripes);
+		bdev_lock_stripes(dev, stripes, excl);
+
+		// Integrity was turned on while we waited for the stripes
+		if(op_is_write(req_op(req)) && !excl && dev->csums) {
+			bdev_unlock_stripes(dev, stripes, false);
+			excl = true;
+			bdev_lock_stripes(dev, stripes, true);
+		}
+
+		status = bdev_do_rw(dev, req, pos);
+		bdev_unlock_stripes(dev, stripes, excl);
+
+		if(dev->zones && op_is_write(req_op(req)))
+			bdev_zone_write_end(dev, req, pos, status);
+
+		// FUA only has to push this request's own pages past the cache
+		if(!status && (req->cmd_flags & REQ_FUA) && dev->cache.max_pages) {
+			err = bdev_cache_writeback(dev, pos >> (PAGE_SHIFT - SECTOR_SHIFT),
+				(pos + blk_rq_sectors(req) - 1) >> (PAGE_SHIFT - SECTOR_SHIFT));
+			status = errno_to_blk_status(err);
+		}
+		return status;
+	case REQ_OP_FLUSH:
+		return bdev_cache_flush(dev);
+	case REQ_OP_DISCARD:
+	case REQ_OP_WRITE_ZEROES:
+		return bdev_do_discard(dev, req);
+	case REQ_OP_ZONE_OPEN:
+	case REQ_OP_ZONE_CLOSE:
+	case REQ_OP_ZONE_FINISH:
+	case REQ_OP_ZONE_RESET:
+	case REQ_OP_ZONE_RESET_ALL:
+		if(!dev->zones)
+			return BLK_STS_NOTSUPP;
+		return bdev_zone_mgmt(dev, req);
+	default:
+		return BLK_STS_NOTSUPP;
+	}
+}
+
+/*
+ * Finishes a request according to irqmode. The data has already
+ * been transferred at this point; only the completion is deferred.
+ */
+static void bdev_complete_cmd(struct bdev *dev, struct request *req, blk_status_t status)
+{
+	struct bdev_cmd *cmd = blk_mq_rq_to_pdu(req);
+
+	cmd->status = status;
+
+	switch(irqmode) {
+	case BDEV_IRQ_SOFTIRQ:
+		blk_mq_complete_request(req);
+		break;
+	case BDEV_IRQ_TIMER:
+		hrtimer_start(&cmd->timer, ns_to_ktime(completion_nsec), HRTIMER_MODE_REL);
+		break;
+	default:
+		bdev_end_request(dev, req, status);
+		break;
+	}
+}
+
+static enum hrtimer_restart bdev_cmd_timer_expired(struct hrtimer *timer)
+{
+	struct bdev_cmd *cmd = container_of(timer, struct bdev_cmd, timer);
+
+	blk_mq_complete_request(cmd->rq);
+	return HRTIMER_NORESTART;
+}
+
+// ->complete, reached from blk_mq_complete_request()
+static void bdev_complete_rq(struct request *req)
+{
+	struct bdev_cmd *cmd = blk_mq_rq_to_pdu(req);
+
+	bdev_end_request(req->rq_disk->private_data, req, cmd->status);
+}
+
+/*
+ * On a poll queue the data has already been moved by the time
+ * ->queue_rq returns, so all that's left is to park the request
+ * until the submitter polls for it.
+ */
+static void bdev_poll_add(struct blk_mq_hw_ctx *hctx, struct request *req, blk_status_t status)
+{
+	struct bdev_pollq *pq = hctx->driver_data;
+	struct bdev_cmd *cmd = blk_mq_rq_to_pdu(req);
+
+	cmd->status = status;
+
+	spin_lock(&pq->lock);
+	list_add_tail(&cmd->poll_list, &pq->list);
+	spin_unlock(&pq->lock);
+}
+
+static int bdev_poll(struct blk_mq_hw_ctx *hctx)
+{
+	struct bdev_pollq *pq = hctx->driver_data;
+	struct bdev_cmd *cmd, *next;
+	LIST_HEAD(list);
+	int nr = 0;
+
+	spin_lock(&pq->lock);
+	list_splice_init(&pq->list, &list);
+	spin_unlock(&pq->lock);
+
+	list_for_each_entry_safe(cmd, next, &list, poll_list) {
+		struct request *req = cmd->rq;
+
+		list_del_init(&cmd->poll_list);
+		bdev_end_request(req->rq_disk->private_data, req, cmd->status);
+		nr++;
+	}
+
+	return nr;
+}
+
+static int bdev_init_hctx(struct blk_mq_hw_ctx *hctx, void *data, unsigned int hctx_idx)
+{
+	struct bdev_pollq *pq;
+
+	pq = kzalloc_node(sizeof(struct bdev_pollq), GFP_KERNEL, hctx->numa_node);
+	if(!pq)
+		return -ENOMEM;
+
+	spin_lock_init(&pq->lock);
+	INIT_LIST_HEAD(&pq->list);
+	hctx->driver_data = pq;
+	return 0;
+}
+
+static void bdev_exit_hctx(struct blk_mq_hw_ctx *hctx, unsigned int hctx_idx)
+{
+	kfree(hctx->driver_data);
+	hctx->driver_data = NULL;
+}
+
+/*
+ * The default map covers the nr_hw_queues regular queues and the
+ * poll map the poll_queues after them. There are no separate read
+ * queues.
+ */
+static int bdev_map_queues(struct blk_mq_tag_set *set)
+{
+	unsigned int i, qoff;
+
+	for(i = 0, qoff = 0; i < set->nr_maps; i++) {
+		struct blk_mq_queue_map *map = &set->map[i];
+
+		switch(i) {
+		case HCTX_TYPE_DEFAULT:
+			map->nr_queues = nr_hw_queues;
+			break;
+		case HCTX_TYPE_POLL:
+			map->nr_queues = poll_queues;
+			break;
+		default:
+			map->nr_queues = 0;
+			continue;
+		}
+
+		map->queue_offset = qoff;
+		qoff += map->nr_queues;
+		blk_mq_map_queues(map);
+	}
+
+	return 0;
+}
+
+static int bdev_init_request(struct blk_mq_tag_set *set, struct request *req,
+							unsigned int hctx_idx, unsigned int numa_node)
+{
+	struct bdev_cmd *cmd = blk_mq_rq_to_pdu(req);
+
+	cmd->rq = req;
+	INIT_LIST_HEAD(&cmd->poll_list);
+	hrtimer_init(&cmd->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	cmd->timer.function = bdev_cmd_timer_expired;
+	return 0;
+}
+
+/*
+ * Bandwidth cap. A request is let through whenever there's any
+ * budget left and takes its whole size out of it, so a request
+ * bigger than one tick's worth still goes and the budget is left
+ * in deficit for the following ticks to pay off. Once the budget
+ * is used up the hardware queues are stopped and the request is
+ * pushed back to the block layer, until the timer refills the
+ * budget and restarts them.
+ */
+static bool bdev_throttled(struct bdev *dev, struct request *req)
+{
+	long bytes = blk_rq_bytes(req);
+
+	if(!mbps)
+		return false;
+
+	if(atomic_long_fetch_sub(bytes, &dev->bw_budget) > 0)
+		return false;
+
+	// Not admitted, so it doesn't count against the budget
+	atomic_long_add(bytes, &dev->bw_budget);
+	blk_mq_stop_hw_queues(dev->queue);
+
+	// The budget may have been refilled before the queues stopped
+	if(atomic_long_read(&dev->bw_budget) > 0)
+		blk_mq_start_stopped_hw_queues(dev->queue, true);
+
+	return true;
+}
+
+static enum hrtimer_restart bdev_bw_timer_expired(struct hrtimer *timer)
+{
+	struct bdev *dev = container_of(timer, struct bdev, bw_timer);
+	long tick = div_u64((u64) mbps * 1024 * 1024, NSEC_PER_SEC / BDEV_BW_TICK_NS);
+	long old, new;
+
+	// Pay off any deficit, but don't build up more than a short burst
+	do {
+		old = atomic_long_read(&dev->bw_budget);
+		new = min(old + tick, tick * BDEV_BW_BURST_TICKS);
+	} while(old < new && atomic_long_cmpxchg(&dev->bw_budget, old, new) != old);
+
+	blk_mq_start_stopped_hw_queues(dev->queue, true);
+
+	hrtimer_forward_now(timer, ns_to_ktime(BDEV_BW_TICK_NS));
+	return HRTIMER_RESTART;
+}
+
+/*
+ * Userspace-served mode. With userspace=1 the store isn't used;
+ * every request is handed to a daemon through the ring described
+ * in bdev_ring.h, which lives on the companion misc device. The
+ * request stays in flight until the daemon posts its completion.
+ *
+ * Request data is copied between the bio pages and the tag's
+ * buffer in the shared mapping. Mapping the bio pages themselves
+ * into the daemon would save the copy, but would mean taking the
+ * daemon's mmap lock and shooting down its TLB for every request,
+ * which costs more than copying up to BDEV_RING_BUF_SIZE bytes.
+ */
+static void bdev_ring_copy(struct request *req, u8 *buf, bool to_buf)
+{
+	struct req_iterator iter;
+	struct bio_vec bvec;
+	void *mem;
+
+	rq_for_each_segment(bvec, req, iter) {
+		mem = kmap_atomic(bvec.bv_page);
+		if(to_buf)
+			memcpy(buf, mem + bvec.bv_offset, bvec.bv_len);
+		else
+			memcpy(mem + bvec.bv_offset, buf, bvec.bv_len);
+		kunmap_atomic(mem);
+		buf += bvec.bv_len;
+	}
+}
+
+static blk_status_t bdev_ring_queue(struct bdev *dev, struct request *req)
+{
+	struct bdev_ring *ring = dev->ring;
+	struct bdev_ring_sqe *sqe;
+	u8 op;
+
+	if(!ring)
+		return BLK_STS_IOERR;
+
+	switch(req_op(req)) {
+	case REQ_OP_READ:
+		op = BDEV_RING_OP_READ;
+		break;
+	case REQ_OP_WRITE:
+		op = BDEV_RING_OP_WRITE;
+		break;
+	case REQ_OP_FLUSH:
+		op = BDEV_RING_OP_FLUSH;
+		break;
+	case REQ_OP_DISCARD:
+		op = BDEV_RING_OP_DISCARD;
+		break;
+	case REQ_OP_WRITE_ZEROES:
+		op = BDEV_RING_OP_WRITE_ZEROES;
+		break;
+	default:
+		return BLK_STS_NOTSUPP;
+	}
+
+	if(op == BDEV_RING_OP_WRITE)
+		bdev_ring_copy(req, ring->bufs + req->tag * BDEV_RING_BUF_SIZE, true);
+
+	spin_lock(&ring->sq_lock);
+
+	// Nobody to serve it; fail rather than hang like an unconnected nbd
+	if(!ring->attached) {
+		spin_unlock(&ring->sq_lock);
+		return BLK_STS_IOERR;
+	}
+
+	sqe = &ring->sqes[ring->sq_tail % ring->depth];
+	sqe->op = op;
+	sqe->flags = (req->cmd_flags & REQ_FUA) ? BDEV_RING_F_FUA : 0;
+	sqe->tag = req->tag;
+	sqe->len = blk_rq_bytes(req);
+	sqe->offset = (u64) blk_rq_pos(req) << SECTOR_SHIFT;
+	set_bit(req->tag, ring->inflight);
+	smp_store_release(&ring->hdr->sq_tail, ++ring->sq_tail);
+
+	spin_unlock(&ring->sq_lock);
+
+	wake_up(&ring->wait);
+	return BLK_STS_OK;
+}
+
+/*
+ * Completes whatever the daemon has posted. Nothing the daemon
+ * writes is trusted: tags that aren't outstanding are ignored, so
+ * a confused daemon can't complete a request twice.
+ */
+static void bdev_ring_reap(struct bdev_ring *ring)
+{
+	struct bdev *dev = ring->dev;
+	struct bdev_ring_cqe *cqe;
+	struct request *req;
+	blk_status_t status;
+	u32 tail;
+	u16 tag;
+	s32 res;
+
+	mutex_lock(&ring->cq_lock);
+
+	tail = smp_load_acquire(&ring->hdr->cq_tail);
+	if(tail - ring->cq_head > ring->depth)
+		tail = ring->cq_head + ring->depth;
+
+	while(ring->cq_head != tail) {
+		cqe = &ring->cqes[ring->cq_head % ring->depth];
+		tag = READ_ONCE(cqe->tag);
+		res = READ_ONCE(cqe->result);
+		ring->cq_head++;
+
+		if(tag >= ring->depth || !test_and_clear_bit(tag, ring->inflight))
+			continue;
+
+		req = blk_mq_tag_to_rq(dev->set->tags[0], tag);
+		status = res ? errno_to_blk_status(res) : BLK_STS_OK;
+		if(!status && req_op(req) == REQ_OP_READ)
+			bdev_ring_copy(req, ring->bufs + tag * BDEV_RING_BUF_SIZE, false);
+		bdev_end_request(dev, req, status);
+	}
+
+	smp_store_release(&ring->hdr->cq_head, ring->cq_head);
+	mutex_unlock(&ring->cq_lock);
+}
+
+static bool bdev_ring_pending(struct bdev_ring *ring)
+{
+	return ring->sq_tail != smp_load_acquire(&ring->hdr->sq_head);
+}
+
+static int bdev_ring_open(struct inode *inode, struct file *filp)
+{
+	struct bdev_ring *ring = container_of(filp->private_data, struct bdev_ring, misc);
+	int err = 0;
+
+	spin_lock(&ring->sq_lock);
+	if(ring->attached) {
+		err = -EBUSY;
+	}
+	else {
+		// Start from a clean ring; nothing can be outstanding while detached
+		memset(ring->hdr, 0, offsetof(struct bdev_ring_hdr, depth));
+		ring->sq_tail = 0;
+		ring->cq_head = 0;
+		ring->attached = true;
+	}
+	spin_unlock(&ring->sq_lock);
+
+	filp->private_data = ring;
+	return err;
+}
+
+// The daemon went away, so whatever it was serving fails
+static int bdev_ring_release(struct inode *inode, struct file *filp)
+{
+	struct bdev_ring *ring = filp->private_data;
+	struct request *req;
+	unsigned int tag;
+
+	spin_lock(&ring->sq_lock);
+	ring->attached = false;
+	spin_unlock(&ring->sq_lock);
+
+	mutex_lock(&ring->cq_lock);
+	for_each_set_bit(tag, ring->inflight, ring->depth) {
+		if(!test_and_clear_bit(tag, ring->inflight))
+			continue;
+		req = blk_mq_tag_to_rq(ring->dev->set->tags[0], tag);
+		bdev_end_request(ring->dev, req, BLK_STS_IOERR);
+	}
+	mutex_unlock(&ring->cq_lock);
+
+	return 0;
+}
+
+static int bdev_ring_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct bdev_ring *ring = filp->private_data;
+
+	return remap_vmalloc_range(vma, ring->mem, vma->vm_pgoff);
+}
+
+static long bdev_ring_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct bdev_ring *ring = filp->private_data;
+	int err;
+
+	if(cmd != BDEV_RING_IOC_ENTER)
+		return -ENOTTY;
+
+	bdev_ring_reap(ring);
+
+	if(arg & BDEV_RING_ENTER_WAIT) {
+		err = wait_event_interruptible(ring->wait, bdev_ring_pending(ring));
+		if(err)
+			return err;
+	}
+
+	return ring->sq_tail - smp_load_acquire(&ring->hdr->sq_head);
+}
+
+static __poll_t bdev_ring_poll(struct file *filp, poll_table *wait)
+{
+	struct bdev_ring *ring = filp->private_data;
+
+	poll_wait(filp, &ring->wait, wait);
+	return bdev_ring_pending(ring) ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+static const struct file_operations bdev_ring_fops = {
+	.owner			= THIS_MODULE,
+	.open			= bdev_ring_open,
+	.release		= bdev_ring_release,
+	.mmap			= bdev_ring_mmap,
+	.unlocked_ioctl	= bdev_ring_ioctl,
+	.poll			= bdev_ring_poll,
+	.llseek			= noop_llseek,
+};
+
+static void bdev_ring_destroy(struct bdev *dev)
+{
+	struct bdev_ring *ring = dev->ring;
+
+	if(!ring)
+		return;
+
+	misc_deregister(&ring->misc);
+	vfree(ring->mem);
+	kfree(ring);
+	dev->ring = NULL;
+}
+
+// Needs the disk name, so is called once the gendisk is set up
+static int bdev_ring_create(struct bdev *dev)
+{
+	struct bdev_ring *ring;
+	struct bdev_ring_hdr *hdr;
+	size_t sqes_off, cqes_off, bufs_off, size;
+	int err;
+
+	ring = kzalloc(sizeof(struct bdev_ring), GFP_KERNEL);
+	if(!ring)
+		return -ENOMEM;
+
+	ring->dev = dev;
+	ring->depth = dev->set->queue_depth;
+	spin_lock_init(&ring->sq_lock);
+	mutex_init(&ring->cq_lock);
+	init_waitqueue_head(&ring->wait);
+
+	sqes_off = PAGE_ALIGN(sizeof(struct bdev_ring_hdr));
+	cqes_off = sqes_off + ring->depth * sizeof(struct bdev_ring_sqe);
+	bufs_off = PAGE_ALIGN(cqes_off + ring->depth * sizeof(struct bdev_ring_cqe));
+	size = bufs_off + (size_t) ring->depth * BDEV_RING_BUF_SIZE;
+
+	ring->mem = vmalloc_user(size);
+	if(!ring->mem) {
+		err = -ENOMEM;
+		goto out_free;
+	}
+
+	hdr = ring->mem;
+	hdr->depth = ring->depth;
+	hdr->buf_size = BDEV_RING_BUF_SIZE;
+	hdr->dev_size = dev->size;
+	hdr->sqes_off = sqes_off;
+	hdr->cqes_off = cqes_off;
+	hdr->bufs_off = bufs_off;
+	hdr->map_size = size;
+	ring->hdr = hdr;
+	ring->sqes = ring->mem + sqes_off;
+	ring->cqes = ring->mem + cqes_off;
+	ring->bufs = ring->mem + bufs_off;
+
+	snprintf(ring->name, sizeof(ring->name), "%s-ctl", dev->gd->disk_name);
+	ring->misc.minor = MISC_DYNAMIC_MINOR;
+	ring->misc.name = ring->name;
+	ring->misc.fops = &bdev_ring_fops;
+	err = misc_register(&ring->misc);
+	if(err)
+		goto out_vfree;
+
+	dev->ring = ring;
+	return 0;
+
+out_vfree:
+	vfree(ring->mem);
+out_free:
+	kfree(ring);
+	return err;
+}
+
+/*
+ * This code is heavily modified due to changes in the 
+ * request_queue and request structures in the linux
+ * kernel since ldd3 was published. 
+ *
+ * With one hardware context per CPU this is called
+ * concurrently for the same device, so it must only
+ * touch per-request state and the page store, which
+ * copes with racing inserts on its own. Requests lock
+ * only the stripes covering their own range.
+ */
+static blk_status_t bdev_request(struct blk_mq_hw_ctx *hctx, const struct blk_mq_queue_data *bd)
+{
+	struct request *req = bd->rq;
+	struct bdev *dev = req->rq_disk->private_data;
+	blk_status_t status;
+
+	if(bdev_throttled(dev, req) || bdev_cache_full(dev, req))
+		return BLK_STS_DEV_RESOURCE;
+
+	// Start processing the request queue
+	blk_mq_start_request(req);
+	bdev_stats_start(dev, req);
+	trace_bdev_submit(req);
+
+	/*
+	 * blk_rq_is_passthrough(req) is the new version
+	 * blk_fs_request(req).
+	 */
+	if(blk_rq_is_passthrough(req)) {
+		bdev_dbg("skip non-fs request\n");
+		bdev_end_request(dev, req, BLK_STS_IOERR);
+		return BLK_STS_OK;
+	}
+
+	// The daemon completes it later through the ring
+	if(userspace) {
+		status = bdev_ring_queue(dev, req);
+		if(status)
+			bdev_end_request(dev, req, status);
+		return BLK_STS_OK;
+	}
+
+	status = bdev_handle_rq(dev, req);
+
+	// Finish processing the request queue
+	if(hctx->type == HCTX_TYPE_POLL)
+		bdev_poll_add(hctx, req, status);
+	else
+		bdev_complete_cmd(dev, req, status);
+	return BLK_STS_OK;
+}
+
+static int bdev_open(struct block_device *bdev, fmode_t mode)
+{
+	struct bdev *dev = bdev->bd_disk->private_data;
+
+	bdev_dbg("%s opened\n", bdev->bd_disk->disk_name);
+
+	spin_lock(&dev->lock);
+
+	if(!dev->users)
+		check_disk_change(bdev);
+	dev->users++;
+
+	spin_unlock(&dev->lock);
+	return 0;
+}
+
+static void bdev_release(struct gendisk *gd, fmode_t mode)
+{
+	struct bdev *dev = gd->private_data;
+
+	bdev_dbg("%s released\n", gd->disk_name);
+
+	spin_lock(&dev->lock);
+
+	dev->users--;
+
+	spin_unlock(&dev->lock);
+}
+
+static struct block_device_operations bdev_ops = {
+	.owner			= THIS_MODULE,
+	.open 			= bdev_open,
+	.release 		= bdev_release,
+	.report_zones	= bdev_report_zones,
+};
+
+static struct blk_mq_ops mq_ops = {
+	.queue_rq		= bdev_request,
+	.complete		= bdev_complete_rq,
+	.init_request	= bdev_init_request,
+	.init_hctx		= bdev_init_hctx,
+	.exit_hctx		= bdev_exit_hctx,
+	.map_queues		= bdev_map_queues,
+	.poll			= bdev_poll,
+};
+
+/*
+ * debugfs interface, one directory per device under
+ * /sys/kernel/debug/bdev/:
+ *
+ *	stats	 request, byte, error and in-flight counts
+ *	latency	 log2 service time histogram per op type
+ *	percentiles	 p50/p99 per op type, from the histogram
+ *	reset	 write anything to zero the counters
+ */
+static void bdev_stats_sum(struct bdev *dev, struct bdev_stats *sum)
+{
+	int cpu, op, b;
+
+	memset(sum, 0, sizeof(struct bdev_stats));
+	for_each_possible_cpu(cpu) {
+		struct bdev_stats *st = per_cpu_ptr(dev->stats, cpu);
+
+		for(op = 0; op < BDEV_STAT_NR; op++) {
+			sum->ios[op] += st->ios[op];
+			sum->bytes[op] += st->bytes[op];
+			for(b = 0; b < BDEV_LAT_BUCKETS; b++)
+				sum->lat[op][b] += st->lat[op][b];
+		}
+		sum->errors += st->errors;
+		sum->inflight += st->inflight;
+		sum->comp_ns += st->comp_ns;
+		sum->decomp_ns += st->decomp_ns;
+		sum->csum_ns += st->csum_ns;
+	}
+}
+
+static int bdev_stats_show(struct seq_file *s, void *v)
+{
+	struct bdev *dev = s->private;
+	struct bdev_stats *sum;
+	int op;
+
+	sum = kmalloc(sizeof(struct bdev_stats), GFP_KERNEL);
+	if(!sum)
+		return -ENOMEM;
+	bdev_stats_sum(dev, sum);
+
+	for(op = 0; op < BDEV_STAT_NR; op++) {
+		seq_printf(s, "%s_ios %llu\n", bdev_stat_names[op], sum->ios[op]);
+		seq_printf(s, "%s_bytes %llu\n", bdev_stat_names[op], sum->bytes[op]);
+	}
+	seq_printf(s, "errors %llu\n", sum->errors);
+	seq_printf(s, "inflight %ld\n", sum->inflight);
+
+	kfree(sum);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(bdev_stats);
+
+static int bdev_latency_show(struct seq_file *s, void *v)
+{
+	struct bdev *dev = s->private;
+	struct bdev_stats *sum;
+	int op, b;
+
+	sum = kmalloc(sizeof(struct bdev_stats), GFP_KERNEL);
+	if(!sum)
+		return -ENOMEM;
+	bdev_stats_sum(dev, sum);
+
+	// One line per non-empty bucket: op, lower bound in ns, count
+	for(op = 0; op < BDEV_STAT_NR; op++) {
+		for(b = 0; b < BDEV_LAT_BUCKETS; b++) {
+			if(!sum->lat[op][b])
+				continue;
+			seq_printf(s, "%s %llu %llu\n", bdev_stat_names[op],
+				b ? 1ULL << b : 0ULL, sum->lat[op][b]);
+		}
+	}
+
+	kfree(sum);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(bdev_latency);
+
+/*
+ * Upper bound of the bucket holding the pct'th percentile. With
+ * log2 buckets this is only accurate to a factor of two, which is
+ * enough to tell polled and interrupt-style completions apart.
+ */
+static u64 bdev_lat_percentile(u64 *lat, u64 total, unsigned int pct)
+{
+	u64 seen = 0, want = div_u64(total * pct + 99, 100);
+	int b;
+
+	for(b = 0; b < BDEV_LAT_BUCKETS; b++) {
+		seen += lat[b];
+		if(seen >= want)
+			return 1ULL << (b + 1);
+	}
+	return 1ULL << BDEV_LAT_BUCKETS;
+}
+
+static int bdev_percentiles_show(struct seq_file *s, void *v)
+{
+	struct bdev *dev = s->private;
+	struct bdev_stats *sum;
+	u64 total;
+	int op, b;
+
+	sum = kmalloc(sizeof(struct bdev_stats), GFP_KERNEL);
+	if(!sum)
+		return -ENOMEM;
+	bdev_stats_sum(dev, sum);
+
+	// op, p50 and p99 upper bounds in ns
+	for(op = 0; op < BDEV_STAT_NR; op++) {
+		for(total = 0, b = 0; b < BDEV_LAT_BUCKETS; b++)
+			total += sum->lat[op][b];
+		if(!total)
+			continue;
+		seq_printf(s, "%s p50 %llu p99 %llu\n", bdev_stat_names[op],
+			bdev_lat_percentile(sum->lat[op], total, 50),
+			bdev_lat_percentile(sum->lat[op], total, 99));
+	}
+
+	kfree(sum);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(bdev_percentiles);
+
+/*
+ * Zeroes every counter except inflight, which tracks requests
+ * that are still outstanding and would go wrong if cleared.
+ */
+static ssize_t bdev_reset_write(struct file *filp, const char __user *buf,
+							size_t count, loff_t *pos)
+{
+	struct bdev *dev = file_inode(filp)->i_private;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct bdev_stats *st = per_cpu_ptr(dev->stats, cpu);
+
+		memset(st->ios, 0, sizeof(st->ios));
+		memset(st->bytes, 0, sizeof(st->bytes));
+		memset(st->lat, 0, sizeof(st->lat));
+		st->errors = 0;
+		st->comp_ns = 0;
+		st->decomp_ns = 0;
+		st->csum_ns = 0;
+	}
+
+	return count;
+}
+
+static const struct file_operations bdev_reset_fops = {
+	.owner	= THIS_MODULE,
+	.open	= simple_open,
+	.write	= bdev_reset_write,
+	.llseek	= noop_llseek,
+};
+
+static void bdev_debugfs_add(struct bdev *dev)
+{
+	if(!bdev_debugfs_root)
+		return;
+
+	dev->debugfs_dir = debugfs_create_dir(dev->gd->disk_name, bdev_debugfs_root);
+	debugfs_create_file("stats", S_IRUGO, dev->debugfs_dir, dev, &bdev_stats_fops);
+	debugfs_create_file("latency", S_IRUGO, dev->debugfs_dir, dev, &bdev_latency_fops);
+	debugfs_create_file("percentiles", S_IRUGO, dev->debugfs_dir, dev, &bdev_percentiles_fops);
+	debugfs_create_file("reset", S_IWUSR, dev->debugfs_dir, dev, &bdev_reset_fops);
+}
+
+/*
+ * sysfs attributes, under /sys/block/<disk>/bdev/. These report
+ * how well the store is compressing and what it costs:
+ *
+ *	orig_data_size		bytes of data stored
+ *	compr_data_size		bytes actually used to hold it
+ *	compr_ratio		orig_data_size / compr_data_size
+ *	huge_pages		pages that didn't compress and are kept raw
+ *	same_pages		pages stored as a repeated word
+ *	same_saved_bytes	memory those would otherwise take up
+ *	numa_pages		raw pages resident on each NUMA node
+ *	cache_pages		pages held in the write cache
+ *	disksize		device size in bytes, writable to resize
+ *	snapshot		write to snapshot the device, read to list snapshots
+ *	rollback		write a device name to take on its contents
+ *	comp_time_ns		CPU time spent compressing
+ *	decomp_time_ns		CPU time spent decompressing
+ *	integrity		1 if sectors are checksummed, writable to switch
+ *	integrity_errors	reads that failed checksum verification
+ *	csum_time_ns		CPU time spent checksumming
+ *	backing_dirty		pages changed since the image was last written
+ *	backing_writeback	write to save changes back to the image
+ */
+static struct bdev *dev_to_bdev(struct device *d)
+{
+	return dev_to_disk(d)->private_data;
+}
+
+/*
+ * The store counters describe the device's own top store; pages
+ * shared with snapshots through frozen stores aren't included.
+ * Holding any stripe keeps the top store from being swapped out
+ * underneath us.
+ */
+static struct bdev_store *bdev_pin_store(struct bdev *dev)
+{
+	down_read(&dev->stripes[0].sem);
+	return dev->store;
+}
+
+static void bdev_unpin_store(struct bdev *dev)
+{
+	up_read(&dev->stripes[0].sem);
+}
+
+// Reads one of the top store's counters
+#define bdev_store_stat(dev, field) ({					\
+	u64 __val = atomic64_read(&bdev_pin_store(dev)->field);	\
+	bdev_unpin_store(dev);								\
+	__val;											\
+})
+
+static u64 bdev_orig_data_size(struct bdev *dev)
+{
+	return bdev_store_stat(dev, pages_stored) << PAGE_SHIFT;
+}
+
+static u64 bdev_compr_data_size(struct bdev *dev)
+{
+	return bdev_store_stat(dev, compr_bytes) +
+		(bdev_store_stat(dev, huge_pages) << PAGE_SHIFT);
+}
+
+static ssize_t orig_data_size_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%llu\n", bdev_orig_data_size(dev_to_bdev(d)));
+}
+static DEVICE_ATTR_RO(orig_data_size);
+
+static ssize_t compr_data_size_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%llu\n", bdev_compr_data_size(dev_to_bdev(d)));
+}
+static DEVICE_ATTR_RO(compr_data_size);
+
+static ssize_t compr_ratio_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	struct bdev *dev = dev_to_bdev(d);
+	u64 orig = bdev_orig_data_size(dev);
+	u64 compr = bdev_compr_data_size(dev);
+	u64 ratio;
+
+	if(!compr)
+		return sprintf(buf, "0.00\n");
+
+	ratio = div64_u64(orig * 100, compr);
+	return sprintf(buf, "%llu.%02llu\n", ratio / 100, ratio % 100);
+}
+static DEVICE_ATTR_RO(compr_ratio);
+
+static ssize_t huge_pages_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lld\n", (s64) bdev_store_stat(dev_to_bdev(d), huge_pages));
+}
+static DEVICE_ATTR_RO(huge_pages);
+
+static ssize_t same_pages_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lld\n", (s64) bdev_store_stat(dev_to_bdev(d), same_pages));
+}
+static DEVICE_ATTR_RO(same_pages);
+
+static ssize_t same_saved_bytes_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	u64 pages = bdev_store_stat(dev_to_bdev(d), same_pages);
+
+	return sprintf(buf, "%llu\n", pages << PAGE_SHIFT);
+}
+static DEVICE_ATTR_RO(same_saved_bytes);
+
+static ssize_t numa_pages_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	struct bdev *dev = dev_to_bdev(d);
+	struct bdev_store *store;
+	ssize_t len = 0;
+	int nid;
+
+	store = bdev_pin_store(dev);
+	for_each_online_node(nid)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%sN%d=%ld", len ? " " : "",
+			nid, atomic_long_read(&store->node_pages[nid]));
+	bdev_unpin_store(dev);
+
+	len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+	return len;
+}
+static DEVICE_ATTR_RO(numa_pages);
+
+static ssize_t cache_pages_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lld\n", (s64) atomic64_read(&dev_to_bdev(d)->cache.store.pages_stored));
+}
+static DEVICE_ATTR_RO(cache_pages);
+
+static ssize_t disksize_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%llu\n", READ_ONCE(dev_to_bdev(d)->size));
+}
+
+/*
+ * Resizes the device while it's in use. Growing only changes the
+ * size, since pages are allocated as they're written. Shrinking
+ * announces the new capacity first so no new I/O is sent past it,
+ * then drops whatever was stored beyond the end. Neither depends
+ * on how big the device is.
+ */
+static ssize_t disksize_store(struct device *d, struct device_attribute *attr,
+							const char *buf, size_t len)
+{
+	struct bdev *dev = dev_to_bdev(d);
+	DECLARE_BITMAP(stripes, BDEV_STRIPES);
+	u32 *csums = NULL, *old_csums;
+	u64 size, old, keep;
+	int err = 0;
+
+	size = memparse(buf, NULL);
+	if(!size || !IS_ALIGNED(size, dev_sector_size))
+		return -EINVAL;
+
+	// Zone layout is fixed when the device is created, the daemon owns the size and the image sets it
+	if(dev->zones || userspace || dev->file)
+		return -EOPNOTSUPP;
+
+	mutex_lock(&dev->resize_lock);
+	old = dev->size;
+
+	if(dev->csums) {
+		csums = kvmalloc_array(size >> SECTOR_SHIFT, sizeof(u32), GFP_KERNEL);
+		if(!csums) {
+			mutex_unlock(&dev->resize_lock);
+			return -ENOMEM;
+		}
+	}
+
+	if(size < old)
+		set_capacity_revalidate_and_notify(dev->gd, size >> SECTOR_SHIFT, true);
+
+	bdev_lock_all(dev, stripes);
+	WRITE_ONCE(dev->size, size);
+	if(size < old)
+		err = bdev_discard_range(dev, size, old - size);
+
+	// Anything past the old end reads back as zeros
+	if(csums) {
+		keep = min(size, old) >> SECTOR_SHIFT;
+		memcpy(csums, dev->csums, keep * sizeof(u32));
+		memset32(csums + keep, bdev_zero_csum, (size >> SECTOR_SHIFT) - keep);
+		old_csums = dev->csums;
+		dev->csums = csums;
+		csums = old_csums;
+	}
+	bdev_unlock_stripes(dev, stripes, true);
+	kvfree(csums);
+
+	if(size > old)
+		set_capacity_revalidate_and_notify(dev->gd, size >> SECTOR_SHIFT, true);
+
+	mutex_unlock(&dev->resize_lock);
+
+	if(err)
+		return err;
+
+	bdev_dbg("%s resized from %llu to %llu bytes\n", dev->gd->disk_name, old, size);
+	return len;
+}
+static DEVICE_ATTR_RW(disksize);
+
+/*
+ * Snapshots. Writing to snapshot creates a new device that shares
+ * this one's current contents copy-on-write; reading it lists the
+ * snapshots taken so far. Writing a device name to rollback makes
+ * this device's contents those of that device (normally one of
+ * its snapshots). Both are constant-time: the current store is
+ * frozen and new empty stores are put on top of it.
+ */
+static struct bdev *bdev_create(int num, u64 size, struct bdev_store *store);
+
+/*
+ * Freezes dev's top store so it can be shared and puts a new empty
+ * store in its place. Anything dirty in the write cache is written
+ * back first so the frozen store is complete. If nothing has been
+ * written since the last freeze the top store is still empty, and
+ * the store below it already holds the same contents, so that's
+ * shared instead of stacking another layer. Otherwise repeated
+ * rollbacks from the same device would grow its chain, and every
+ * lookup of an unchanged page, without bound. Returns the frozen
+ * store with a reference for the caller.
+ */
+static struct bdev_store *bdev_freeze(struct bdev *dev)
+{
+	DECLARE_BITMAP(stripes, BDEV_STRIPES);
+	struct bdev_store *top, *frozen;
+	int err = 0;
+
+	top = bdev_alloc_store();
+	if(!top)
+		return ERR_PTR(-ENOMEM);
+
+	mutex_lock(&dev->cache.wb_lock);
+	bdev_lock_all(dev, stripes);
+
+	if(dev->cache.max_pages)
+		err = __bdev_cache_writeback(dev, 0, ULONG_MAX, false);
+	if(!err && dev->store->parent && xa_empty(&dev->store->slots)) {
+		frozen = dev->store->parent;
+		refcount_inc(&frozen->ref);
+	}
+	else if(!err) {
+		frozen = dev->store;
+		top->parent = frozen;		// Takes over the device's reference
+		refcount_inc(&frozen->ref);	// and this one is the caller's
+		dev->store = top;
+		top = NULL;
+	}
+
+	bdev_unlock_stripes(dev, stripes, true);
+	mutex_unlock(&dev->cache.wb_lock);
+
+	bdev_put_store(top);
+	return err ? ERR_PTR(err) : frozen;
+}
+
+// Called with bdev_devices_lock held
+static struct bdev *bdev_find_device(const char *name)
+{
+	int i;
 
-static int bdev_major = 0;
-static int dev_sector_size = 512;
-static int num_sectors = 1024;
-static int num_devices = 4;
-static int bdev_minors = 16;
+	for(i = 0; i < nr_devices; i++) {
+		if(devices[i] && devices[i]->gd && !strcmp(devices[i]->gd->disk_name, name))
+			return devices[i];
+	}
+	return NULL;
+}
 
-module_param(bdev_major, int, S_IRUGO);
-module_param(dev_sector_size, int, S_IRUGO);
-module_param(num_sectors, int, S_IRUGO);
-module_param(num_devices, int, S_IRUGO);
-module_param(bdev_minors, int, S_IRUGO);
+static ssize_t snapshot_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	struct bdev *dev = dev_to_bdev(d);
+	ssize_t len = 0;
+	int i;
 
-struct bdev {
-	int size;						// Device size (in sectors)
-	u8 *data;						// Data array
-	short users;					// Number of users
-	short media_change;				// Flag for media changed
-	spinlock_t lock;				// For mutual exclusion
-	struct blk_mq_tag_set tag_set;	// Tag set for request queue
-	struct request_queue *queue;	// Device request queue
-	struct gendisk *gd;
-	struct timer_list timer;		// For simulated media changes
-};
+	mutex_lock(&bdev_devices_lock);
+	for(i = 0; i < nr_devices; i++) {
+		if(devices[i] && devices[i]->origin == dev && devices[i]->gd)
+			len += scnprintf(buf + len, PAGE_SIZE - len, "%s%s", len ? " " : "",
+				devices[i]->gd->disk_name);
+	}
+	mutex_unlock(&bdev_devices_lock);
 
-static struct bdev *devices = NULL;
+	len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+	return len;
+}
 
-static void bdev_transfer(struct bdev *dev, unsigned long sector,
-							unsigned long nsect, char *buffer, int write)
+static ssize_t snapshot_store(struct device *d, struct device_attribute *attr,
+							const char *buf, size_t len)
 {
-	unsigned long offset = sector * KERNEL_SECTOR_SIZE;
-	unsigned long nbytes = nsect * KERNEL_SECTOR_SIZE;
+	struct bdev *dev = dev_to_bdev(d), *snap;
+	struct bdev_store *snap_top, *frozen;
+	int err = 0;
 
-	printk(KERN_INFO "bdev: bdev_transfer()\n");
+	// Zone write pointers aren't part of the store, the daemon owns the data,
+	// and pages still in an image would change under the snapshot on writeback
+	if(dev->zones || userspace || dev->file)
+		return -EOPNOTSUPP;
 
-	// Make sure there's room to do the write
-	if((offset + nbytes) > dev->size) {
-		printk(KERN_NOTICE "bdev: beyond-end write (%ld %ld)\n", offset, nbytes);
-		return;
+	snap_top = bdev_alloc_store();
+	if(!snap_top)
+		return -ENOMEM;
+
+	mutex_lock(&bdev_devices_lock);
+	if(nr_devices == num_devices + max_snapshots) {
+		err = -ENOSPC;
+		goto out_unlock;
 	}
 
-	if(write)
-		memcpy(dev->data + offset, buffer, nbytes);
-	else
-		memcpy(buffer, dev->data + offset, nbytes);
+	mutex_lock(&dev->resize_lock);
+	frozen = bdev_freeze(dev);
+	if(IS_ERR(frozen)) {
+		mutex_unlock(&dev->resize_lock);
+		err = PTR_ERR(frozen);
+		goto out_unlock;
+	}
+	snap_top->parent = frozen;
+
+	snap = bdev_create(nr_devices, dev->size, snap_top);
+	mutex_unlock(&dev->resize_lock);
+
+	// bdev_create() owns the store now, even if it failed
+	snap_top = NULL;
+	if(!snap || !snap->gd) {
+		// Nothing but the store is left behind, so the slot can be reused
+		if(snap) {
+			bdev_put_store(snap->store);
+			kfree(snap);
+		}
+		devices[nr_devices] = NULL;
+		err = -ENOMEM;
+		goto out_unlock;
+	}
+	snap->origin = dev;
+	nr_devices++;
+
+	// Checksummed devices have checksummed snapshots
+	if(dev->csums && !snap->csums && bdev_integrity_set(snap, true))
+		printk(KERN_WARNING "bdev: %s: can't enable integrity\n", snap->gd->disk_name);
+
+	printk(KERN_INFO "bdev: %s is a snapshot of %s\n", snap->gd->disk_name, dev->gd->disk_name);
+
+out_unlock:
+	mutex_unlock(&bdev_devices_lock);
+	bdev_put_store(snap_top);
+	return err ? err : len;
+}
+static DEVICE_ATTR_RW(snapshot);
+
+// Takes two devices' resize locks, always in the same (address) order
+static void bdev_lock_resize_pair(struct bdev *a, struct bdev *b)
+{
+	if(a > b)
+		swap(a, b);
+	mutex_lock(&a->resize_lock);
+	mutex_lock_nested(&b->resize_lock, SINGLE_DEPTH_NESTING);
+}
+
+static void bdev_unlock_resize_pair(struct bdev *a, struct bdev *b)
+{
+	mutex_unlock(&a->resize_lock);
+	mutex_unlock(&b->resize_lock);
 }
 
 /*
- * This code is heavily modified due to changes in the 
- * request_queue and request structures in the linux
- * kernel since ldd3 was published. 
+ * Replaces this device's contents with the current contents of
+ * another device. The other device's store is frozen and this
+ * one gets a new empty store on top of it; whatever this device
+ * held before, including its write cache, is dropped.
  */
-static blk_status_t bdev_request(struct blk_mq_hw_ctx *hctx, const struct blk_mq_queue_data *bd)
+static ssize_t rollback_store(struct device *d, struct device_attribute *attr,
+							const char *buf, size_t len)
 {
-	struct request *req = bd->rq;
-	struct bdev *dev = req->rq_disk->private_data;
-	struct bio_vec bvec;
-	struct req_iterator iter;
-	sector_t pos_sector = blk_rq_pos(req);
-	void *buffer;
+	struct bdev *dev = dev_to_bdev(d), *src;
+	struct bdev_store *top, *frozen, *old = NULL;
+	u32 *old_csums = NULL;
+	DECLARE_BITMAP(stripes, BDEV_STRIPES);
+	struct block_device *bdev;
+	char name[DISK_NAME_LEN];
+	int err = 0;
 
-	printk(KERN_INFO "bdev: bdev_request()\n");
+	strlcpy(name, buf, sizeof(name));
+	strim(name);
 
-	// Start processing the request queue
-	blk_mq_start_request(req);
+	top = bdev_alloc_store();
+	if(!top)
+		return -ENOMEM;
 
-	/*
-	 * blk_rq_is_passthrough(req) is the new version
-	 * blk_fs_request(req).
-	 */
-	if(blk_rq_is_passthrough(req)) {
-		printk(KERN_NOTICE "bdev: Skip non-fs request\n");
-		blk_mq_end_request(req, BLK_STS_IOERR);
-		return BLK_STS_IOERR;
+	mutex_lock(&bdev_devices_lock);
+	src = bdev_find_device(name);
+	if(!src || src == dev) {
+		err = -EINVAL;
+		goto out_unlock;
+	}
+	if(src->zones || dev->zones || userspace || src->file || dev->file) {
+		err = -EOPNOTSUPP;
+		goto out_unlock;
 	}
 
-	/*
-	 * This macro replaces the while loop that was needed previously:
-	 * while((req = elv_next_request(q)) != NULL) { 
-	 *    ...
-	 * }
-	 */
-	rq_for_each_segment(bvec, req, iter) {
+	// Both sizes have to stay put until the new store is in place
+	bdev_lock_resize_pair(dev, src);
+	if(src->size != dev->size) {
+		bdev_unlock_resize_pair(dev, src);
+		err = -EINVAL;
+		goto out_unlock;
+	}
 
-		// req->current_nr_sectors
-		size_t num_sector = blk_rq_cur_sectors(req);
+	frozen = bdev_freeze(src);
+	if(IS_ERR(frozen)) {
+		bdev_unlock_resize_pair(dev, src);
+		err = PTR_ERR(frozen);
+		goto out_unlock;
+	}
+	top->parent = frozen;
 
-		printk(KERN_NOTICE "bdev: Req device=%u\tdir=%d\tpos_sector=%lld\tnum_sector=%ld\n",
-			(unsigned)(dev - devices), rq_data_dir(req),
-			pos_sector, num_sector);
+	mutex_lock(&dev->cache.wb_lock);
+	bdev_lock_all(dev, stripes);
+	old = dev->store;
+	dev->store = top;
+	bdev_free_cache(dev);
 
-		buffer = page_address(bvec.bv_page) + bvec.bv_offset;
-		bdev_transfer(dev, pos_sector, num_sector, buffer, rq_data_dir(req) == WRITE);
-		pos_sector += num_sector;
+	// The old checksums are for the old contents
+	if(dev->csums && bdev_csum_generate(dev, dev->csums)) {
+		printk(KERN_WARNING "bdev: %s: integrity turned off\n", dev->gd->disk_name);
+		old_csums = dev->csums;
+		dev->csums = NULL;
 	}
+	bdev_unlock_stripes(dev, stripes, true);
+	mutex_unlock(&dev->cache.wb_lock);
+	bdev_unlock_resize_pair(dev, src);
+	top = NULL;
 
-	// Finish processing the request queue
-	blk_mq_end_request(req, BLK_STS_OK);
-	return BLK_STS_OK;
+	// Anything cached above us is stale now
+	bdev = bdget_disk(dev->gd, 0);
+	if(bdev) {
+		invalidate_bdev(bdev);
+		bdput(bdev);
+	}
+
+	bdev_dbg("%s rolled back to %s\n", dev->gd->disk_name, src->gd->disk_name);
+
+out_unlock:
+	mutex_unlock(&bdev_devices_lock);
+	kvfree(old_csums);
+	bdev_put_store(old);
+	bdev_put_store(top);
+	return err ? err : len;
 }
+static DEVICE_ATTR_WO(rollback);
 
-static int bdev_open(struct block_device *bdev, fmode_t mode)
+static ssize_t comp_time_ns_show(struct device *d, struct device_attribute *attr, char *buf)
 {
-	struct bdev *dev = bdev->bd_disk->private_data;
+	struct bdev *dev = dev_to_bdev(d);
+	u64 ns = 0;
+	int cpu;
 
-	printk(KERN_INFO "bdev: bdev_open()\n");
+	for_each_possible_cpu(cpu)
+		ns += per_cpu_ptr(dev->stats, cpu)->comp_ns;
+	return sprintf(buf, "%llu\n", ns);
+}
+static DEVICE_ATTR_RO(comp_time_ns);
 
-	spin_lock(&dev->lock);
+static ssize_t decomp_time_ns_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	struct bdev *dev = dev_to_bdev(d);
+	u64 ns = 0;
+	int cpu;
 
-	if(!dev->users)
-		check_disk_change(bdev);
-	dev->users++;
+	for_each_possible_cpu(cpu)
+		ns += per_cpu_ptr(dev->stats, cpu)->decomp_ns;
+	return sprintf(buf, "%llu\n", ns);
+}
+static DEVICE_ATTR_RO(decomp_time_ns);
 
-	spin_unlock(&dev->lock);
-	return 0;
+/*
+ * Writes every page changed since the last writeback to the image
+ * and syncs it. Each page is copied out under its stripe, so I/O
+ * keeps going meanwhile; a page written again after it's been
+ * copied is just marked dirty for next time.
+ */
+static int bdev_file_writeback(struct bdev *dev)
+{
+	struct bdev_file *bf = dev->file;
+	struct rw_semaphore *sem;
+	struct page *page;
+	unsigned long idx;
+	unsigned int len;
+	loff_t pos;
+	ssize_t ret;
+	int err = 0;
+
+	page = alloc_page(GFP_KERNEL);
+	if(!page)
+		return -ENOMEM;
+
+	mutex_lock(&bf->wb_lock);
+	for_each_set_bit(idx, bf->dirty, bf->nr_pages) {
+		pos = (loff_t) idx << PAGE_SHIFT;
+		len = min_t(u64, PAGE_SIZE, dev->size - pos);
+
+		sem = bdev_page_stripe(dev, idx);
+		down_read(sem);
+		clear_bit(idx, bf->dirty);
+		err = bdev_transfer(dev, pos >> SECTOR_SHIFT, len, page, 0, false);
+		up_read(sem);
+
+		if(!err) {
+			ret = kernel_write(bf->file, page_address(page), len, &pos);
+			if(ret != len)
+				err = ret < 0 ? ret : -EIO;
+		}
+		if(err) {
+			set_bit(idx, bf->dirty);
+			break;
+		}
+		cond_resched();
+	}
+	if(!err)
+		err = vfs_fsync(bf->file, 0);
+	mutex_unlock(&bf->wb_lock);
+
+	__free_page(page);
+	return err;
 }
 
-static void bdev_release(struct gendisk *gd, fmode_t mode)
+static ssize_t backing_dirty_show(struct device *d, struct device_attribute *attr, char *buf)
 {
-	struct bdev *dev = gd->private_data;
+	struct bdev_file *bf = dev_to_bdev(d)->file;
 
-	printk(KERN_INFO "bdev: bdev_release()\n");
+	return sprintf(buf, "%lu\n", bf ? bitmap_weight(bf->dirty, bf->nr_pages) : 0);
+}
+static DEVICE_ATTR_RO(backing_dirty);
 
-	spin_lock(&dev->lock);
+static ssize_t backing_writeback_store(struct device *d, struct device_attribute *attr,
+							const char *buf, size_t len)
+{
+	struct bdev *dev = dev_to_bdev(d);
+	int err;
 
-	dev->users--;
+	if(!dev->file)
+		return -EINVAL;
 
-	spin_unlock(&dev->lock);
+	err = bdev_file_writeback(dev);
+	if(err)
+		return err;
+
+	bdev_dbg("%s written back to %pD\n", dev->gd->disk_name, dev->file->file);
+	return len;
 }
+static DEVICE_ATTR_WO(backing_writeback);
 
-static struct block_device_operations bdev_ops = {
-	.owner			= THIS_MODULE,
-	.open 			= bdev_open,
-	.release 		= bdev_release,
+static ssize_t integrity_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%d\n", !!READ_ONCE(dev_to_bdev(d)->csums));
+}
+
+static ssize_t integrity_store(struct device *d, struct device_attribute *attr,
+							const char *buf, size_t len)
+{
+	bool on;
+	int err;
+
+	if(kstrtobool(buf, &on))
+		return -EINVAL;
+
+	// The daemon's data never passes through here
+	if(userspace)
+		return -EOPNOTSUPP;
+
+	err = bdev_integrity_set(dev_to_bdev(d), on);
+	return err ? err : len;
+}
+static DEVICE_ATTR_RW(integrity);
+
+static ssize_t integrity_errors_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lld\n", (s64) atomic64_read(&dev_to_bdev(d)->csum_errors));
+}
+static DEVICE_ATTR_RO(integrity_errors);
+
+static ssize_t csum_time_ns_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	struct bdev *dev = dev_to_bdev(d);
+	u64 ns = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		ns += per_cpu_ptr(dev->stats, cpu)->csum_ns;
+	return sprintf(buf, "%llu\n", ns);
+}
+static DEVICE_ATTR_RO(csum_time_ns);
+
+static struct attribute *bdev_attrs[] = {
+	&dev_attr_orig_data_size.attr,
+	&dev_attr_compr_data_size.attr,
+	&dev_attr_compr_ratio.attr,
+	&dev_attr_huge_pages.attr,
+	&dev_attr_same_pages.attr,
+	&dev_attr_same_saved_bytes.attr,
+	&dev_attr_numa_pages.attr,
+	&dev_attr_cache_pages.attr,
+	&dev_attr_disksize.attr,
+	&dev_attr_snapshot.attr,
+	&dev_attr_rollback.attr,
+	&dev_attr_comp_time_ns.attr,
+	&dev_attr_decomp_time_ns.attr,
+	&dev_attr_integrity.attr,
+	&dev_attr_integrity_errors.attr,
+	&dev_attr_csum_time_ns.attr,
+	&dev_attr_backing_dirty.attr,
+	&dev_attr_backing_writeback.attr,
+	NULL,
 };
 
-static struct blk_mq_ops mq_ops = {
-	.queue_rq = bdev_request,
+static const struct attribute_group bdev_attr_group = {
+	.name	= DEVICE_NAME,
+	.attrs	= bdev_attrs,
+};
+
+static const struct attribute_group *bdev_attr_groups[] = {
+	&bdev_attr_group,
+	NULL,
 };
 
-static void setup_device(struct bdev *dev, int num)
+static void bdev_comp_exit(void)
+{
+	int cpu;
+
+	if(bdev_zstrms) {
+		for_each_possible_cpu(cpu) {
+			struct bdev_zstrm *zstrm = per_cpu_ptr(bdev_zstrms, cpu);
+
+			if(zstrm->tfm)
+				crypto_free_comp(zstrm->tfm);
+			kfree(zstrm->buffer);
+			kfree(zstrm->page);
+		}
+		free_percpu(bdev_zstrms);
+		bdev_zstrms = NULL;
+	}
+
+	if(bdev_zpool) {
+		zs_destroy_pool(bdev_zpool);
+		bdev_zpool = NULL;
+	}
+}
+
+/*
+ * Sets up the shared pool and one compression stream per CPU, so
+ * compressing never has to wait for a stream another CPU holds.
+ */
+static int bdev_comp_init(void)
+{
+	int cpu;
+
+	if(!crypto_has_comp(comp_algorithm, 0, 0)) {
+		printk(KERN_WARNING "bdev: compression algorithm %s not available\n", comp_algorithm);
+		return -EINVAL;
+	}
+
+	bdev_zpool = zs_create_pool(DEVICE_NAME);
+	if(!bdev_zpool)
+		return -ENOMEM;
+
+	bdev_zstrms = alloc_percpu(struct bdev_zstrm);
+	if(!bdev_zstrms)
+		goto fail;
+
+	for_each_possible_cpu(cpu) {
+		struct bdev_zstrm *zstrm = per_cpu_ptr(bdev_zstrms, cpu);
+
+		zstrm->tfm = crypto_alloc_comp(comp_algorithm, 0, 0);
+		if(IS_ERR(zstrm->tfm)) {
+			zstrm->tfm = NULL;
+			goto fail;
+		}
+		zstrm->buffer = kmalloc(2 * PAGE_SIZE, GFP_KERNEL);
+		zstrm->page = kmalloc(PAGE_SIZE, GFP_KERNEL);
+		if(!zstrm->buffer || !zstrm->page)
+			goto fail;
+	}
+
+	return 0;
+
+fail:
+	bdev_comp_exit();
+	return -ENOMEM;
+}
+
+/*
+ * Sets up a tag set with one hardware queue per online
+ * CPU (unless overridden with nr_hw_queues) so that
+ * submitters don't all funnel through a single hctx.
+ */
+static int setup_tag_set(struct blk_mq_tag_set *set, int node)
+{
+	memset(set, 0, sizeof(struct blk_mq_tag_set));
+	set->ops = &mq_ops;
+	set->nr_hw_queues = nr_hw_queues + poll_queues;
+	set->nr_maps = poll_queues ? HCTX_MAX_TYPES : 1;
+	set->queue_depth = hw_queue_depth;
+	set->numa_node = node;
+	set->cmd_size = sizeof(struct bdev_cmd);
+
+	/*
+	 * Backing pages are allocated on first write with GFP_NOIO,
+	 * which may sleep, so ->queue_rq must be allowed to block.
+	 */
+	set->flags = BLK_MQ_F_SHOULD_MERGE | BLK_MQ_F_BLOCKING;
+
+	return blk_mq_alloc_tag_set(set);
+}
+
+/*
+ * Names devices bdeva..bdevz, then bdevaa..bdevzz and so on, the
+ * same scheme sd uses, since snapshots can take us past 26.
+ */
+static void bdev_format_name(char *buf, int len, int num)
+{
+	char name[DISK_NAME_LEN];
+	char *p = name + sizeof(name) - 1;
+
+	*p = '\0';
+	do {
+		*--p = 'a' + num % 26;
+		num = num / 26 - 1;
+	} while(num >= 0 && p > name);
+
+	snprintf(buf, len, "%s%s", DEVICE_NAME, p);
+}
+
+/*
+ * Sets up device num with size bytes of capacity. store is the
+ * initial top store, or NULL for a new empty one; either way the
+ * device owns it afterwards, even if setup fails.
+ */
+static void setup_device(struct bdev *dev, int num, u64 size, struct bdev_store *store)
 {
+	int err;
 
-	printk(KERN_INFO "bdev: creating device %d: ", num);
+	bdev_dbg("creating device %d\n", num);
 
 	/*
-     * Get memory for the device's data field.
-     * We use vmalloc since we'll likely want
-     * an amount of data that is larger than
-     * the size of a block.
-     */
+	 * Nothing is allocated for the data itself here. Pages
+	 * are added to the store as they're written, so loading
+	 * the module costs the same regardless of num_sectors.
+	 */
 	memset(dev, 0, sizeof(struct bdev));
-	dev->size = num_sectors * dev_sector_size;
-	dev->data = vmalloc(dev->size);
-	if(dev->data == NULL) {
-		printk(KERN_NOTICE "bdev: vmalloc failure.\n");
+	dev->size = size;
+	bdev_init_stripes(dev);
+	mutex_init(&dev->resize_lock);
+	bdev_init_cache(dev);
+	dev->store = store ? store : bdev_alloc_store();
+	if(!dev->store) {
+		printk(KERN_NOTICE "bdev: store allocation failure.\n");
+		return;
+	}
+
+	if(num < num_devices && num < nr_backing_file && *backing_file[num]) {
+		err = bdev_file_open(dev, backing_file[num]);
+		if(err) {
+			printk(KERN_NOTICE "bdev: can't open %s (%d).\n", backing_file[num], err);
+			return;
+		}
+	}
+
+	dev->node = num < nr_home_node ? home_node[num] : NUMA_NO_NODE;
+	if(dev->node != NUMA_NO_NODE && (dev->node < 0 || dev->node >= nr_node_ids ||
+									!node_online(dev->node))) {
+		printk(KERN_WARNING "bdev: node %d is not online, ignoring\n", dev->node);
+		dev->node = NUMA_NO_NODE;
+	}
+
+	if(zoned && bdev_init_zones(dev)) {
+		printk(KERN_NOTICE "bdev: zone setup failure.\n");
 		return;
 	}
 
+	dev->stats = alloc_percpu(struct bdev_stats);
+	if(!dev->stats) {
+		printk(KERN_NOTICE "bdev: stats allocation failure.\n");
+		goto out_zones;
+	}
+
+	if(integrity && bdev_integrity_set(dev, true))
+		printk(KERN_NOTICE "bdev: checksum allocation failure, integrity is off.\n");
+
 	// Initialize the spin lock used for mutual exclusion
 	spin_lock_init(&dev->lock);
 
 	// TODO: timer that invalidates device
 
-	// Allocate request queue
-	dev->queue = blk_mq_init_sq_queue(&dev->tag_set, &mq_ops, 128, BLK_MQ_F_SHOULD_MERGE);
-	if(dev->queue == NULL) {
-		if(dev->data) 
-			vfree(dev->data);
-		return;
+	// Allocate the tag set and request queue
+	if(shared_tags) {
+		dev->set = &bdev_shared_set;
+	}
+	else {
+		if(setup_tag_set(&dev->tag_set, dev->node)) {
+			printk(KERN_NOTICE "bdev: tag set allocation failure.\n");
+			goto out_stats;
+		}
+		dev->set = &dev->tag_set;
+	}
+
+	dev->queue = blk_mq_init_queue(dev->set);
+	if(IS_ERR(dev->queue)) {
+		printk(KERN_NOTICE "bdev: request queue allocation failure.\n");
+		dev->queue = NULL;
+		goto out_tag_set;
+	}
+	dev->queue->queuedata = dev;
+	blk_queue_logical_block_size(dev->queue, dev_sector_size);
+	blk_queue_max_hw_sectors(dev->queue, max_hw_sectors);
+	blk_queue_max_segment_size(dev->queue, max_segment_size);
+	blk_queue_max_segments(dev->queue, max_segments);
+	if(dev->cache.max_pages)
+		blk_queue_write_cache(dev->queue, true, true);
+
+	/*
+	 * Discard and write zeroes free the backing pages. Zoned
+	 * devices free them on zone reset instead.
+	 */
+	if(!dev->zones) {
+		blk_queue_flag_set(QUEUE_FLAG_DISCARD, dev->queue);
+		dev->queue->limits.discard_granularity = PAGE_SIZE;
+		blk_queue_max_discard_sectors(dev->queue, UINT_MAX >> SECTOR_SHIFT);
+		blk_queue_max_write_zeroes_sectors(dev->queue, UINT_MAX >> SECTOR_SHIFT);
 	}
-	blk_queue_max_segment_size(dev->queue, dev_sector_size);
 
 	// Allocate and initialize gendisk struct
 	dev->gd = alloc_disk(bdev_minors);
 	if(dev->gd == NULL) {
 		printk(KERN_NOTICE "bdev: alloc_disk failure.\n");
-		if(dev->data)
-			vfree(dev->data);
-		return;
+		goto out_queue;
 	}
 
 	// Set up gendisk
@@ -206,12 +4184,124 @@ static void setup_device(struct bdev *dev, int num)
 	dev->gd->fops = &bdev_ops;
 	dev->gd->queue = dev->queue;
 	dev->gd->private_data = dev;
-	snprintf(dev->gd->disk_name, 32, "bdev%c", num + 'a');
-	set_capacity(dev->gd, num_sectors * (dev_sector_size / KERNEL_SECTOR_SIZE));
-	add_disk(dev->gd);
+	bdev_format_name(dev->gd->disk_name, DISK_NAME_LEN, num);
+
+	/*
+	 * In userspace mode there's no daemon yet, so don't have
+	 * add_disk() go looking for partitions. The daemon decides
+	 * what a flush means, so offer it flushes and FUA.
+	 */
+	if(userspace) {
+		if(bdev_ring_create(dev))
+			printk(KERN_NOTICE "bdev: ring setup failure, I/O to %s will fail.\n",
+				dev->gd->disk_name);
+		dev->gd->flags |= GENHD_FL_NO_PART_SCAN;
+		blk_queue_write_cache(dev->queue, true, true);
+	}
+	set_capacity(dev->gd, dev->size / KERNEL_SECTOR_SIZE);
+	if(dev->zones && bdev_register_zones(dev)) {
+		printk(KERN_NOTICE "bdev: zone registration failure.\n");
+		put_disk(dev->gd);
+		dev->gd = NULL;
+		goto out_queue;
+	}
+	device_add_disk(NULL, dev->gd, bdev_attr_groups);
+	bdev_debugfs_add(dev);
+
+	// Start handing out bandwidth, the first tick fills the budget
+	hrtimer_init(&dev->bw_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	dev->bw_timer.function = bdev_bw_timer_expired;
+	if(mbps)
+		hrtimer_start(&dev->bw_timer, 0, HRTIMER_MODE_REL);
+
+	bdev_dbg("created %s\n", dev->gd->disk_name);
+	return;
+
+out_queue:
+	blk_cleanup_queue(dev->queue);
+	dev->queue = NULL;
+out_tag_set:
+	if(dev->set == &dev->tag_set)
+		blk_mq_free_tag_set(&dev->tag_set);
+	dev->set = NULL;
+out_stats:
+	free_percpu(dev->stats);
+	dev->stats = NULL;
+	kvfree(dev->csums);
+	dev->csums = NULL;
+out_zones:
+	kvfree(dev->zones);
+	dev->zones = NULL;
+}
+
+/*
+ * Allocates device num and sets it up. It goes into devices[] even
+ * if setup fails, so that it's cleaned up with the rest; only a
+ * failed allocation leaves the entry empty. Takes over store.
+ */
+static struct bdev *bdev_create(int num, u64 size, struct bdev_store *store)
+{
+	struct bdev *dev;
+
+	dev = kzalloc(sizeof(struct bdev), GFP_KERNEL);
+	if(!dev) {
+		printk(KERN_NOTICE "bdev: device allocation failure.\n");
+		bdev_put_store(store);
+		return NULL;
+	}
+
+	setup_device(dev, num, size, store);
+	devices[num] = dev;
+	return dev;
+}
+
+/*
+ * With lazy, called by the block layer when a device node with our
+ * major is opened and there's no disk behind it yet. Sets up the
+ * device the minor belongs to and hands back its disk.
+ */
+static struct kobject *bdev_probe(dev_t devt, int *part, void *data)
+{
+	struct kobject *kobj = NULL;
+	int num = MINOR(devt) / bdev_minors;
+	struct bdev *dev;
+
+	if(num >= num_devices)
+		return NULL;
+
+	mutex_lock(&bdev_devices_lock);
+	dev = devices[num];
+	if(!dev)
+		dev = bdev_create(num, (u64) num_sectors * dev_sector_size, NULL);
+	if(dev && dev->gd)
+		kobj = get_disk_and_module(dev->gd);
+	mutex_unlock(&bdev_devices_lock);
 
-	printk(KERN_INFO "%s\n", dev->gd->disk_name);
+	*part = 0;
+	return kobj;
+}
+
+/*
+ * Logs roughly what each device costs before it has stored any
+ * data: the device itself (which kmalloc rounds up to a power of
+ * two), its per-CPU stats and, unless they're shared, the requests
+ * preallocated for its tag set. The block layer's own queue
+ * structures come on top of this. Devices that haven't been set up
+ * yet only cost their pointer in devices[].
+ */
+static void bdev_report_overhead(void)
+{
+	size_t dev_bytes = roundup_pow_of_two(sizeof(struct bdev)) +
+						num_possible_cpus() * sizeof(struct bdev_stats);
+	size_t tag_bytes = (size_t) (nr_hw_queues + poll_queues) * hw_queue_depth *
+						(sizeof(struct request) + sizeof(struct bdev_cmd));
 
+	if(shared_tags)
+		printk(KERN_INFO "bdev: ~%zu KB per device, %zu KB of shared requests\n",
+			dev_bytes >> 10, tag_bytes >> 10);
+	else
+		printk(KERN_INFO "bdev: ~%zu KB per device, %zu KB of it requests\n",
+			(dev_bytes + tag_bytes) >> 10, tag_bytes >> 10);
 }
 
 /*
@@ -220,35 +4310,171 @@ static void setup_device(struct bdev *dev, int num)
  */
 static int __init start_module(void)
 {
-	int i;
+	int i, err;
 
 	printk(KERN_INFO "bdev: initializing\n");
 
+	if(nr_hw_queues <= 0)
+		nr_hw_queues = num_online_cpus();
+	if(hw_queue_depth <= 0)
+		hw_queue_depth = 128;
+	if(poll_queues < 0)
+		poll_queues = 0;
+
+	// The block layer refuses limits smaller than a page
+	if(max_hw_sectors < PAGE_SECTORS)
+		max_hw_sectors = PAGE_SECTORS;
+	if(max_segment_size < PAGE_SIZE)
+		max_segment_size = PAGE_SIZE;
+	if(max_segments < 1)
+		max_segments = 1;
+
+	if(numa_policy < BDEV_NUMA_DEVICE || numa_policy > BDEV_NUMA_LOCAL) {
+		printk(KERN_WARNING "bdev: invalid numa_policy %d, using 0\n", numa_policy);
+		numa_policy = BDEV_NUMA_DEVICE;
+	}
+
+	if(zoned && !IS_ENABLED(CONFIG_BLK_DEV_ZONED)) {
+		printk(KERN_WARNING "bdev: kernel built without zoned device support\n");
+		return -EINVAL;
+	}
+	if(zoned && (zone_size <= 0 || !is_power_of_2(zone_size))) {
+		printk(KERN_WARNING "bdev: zone_size must be a power of two\n");
+		return -EINVAL;
+	}
+	if(cache_size < 0)
+		cache_size = 0;
+
+	// The image holds data, not zone state, and the daemon has its own
+	if(nr_backing_file && (zoned || userspace)) {
+		printk(KERN_WARNING "bdev: backing_file can't be combined with zoned or userspace\n");
+		return -EINVAL;
+	}
+
+	// The daemon owns the data, none of the store features apply
+	if(userspace) {
+		if(zoned) {
+			printk(KERN_WARNING "bdev: zoned and userspace can't be combined\n");
+			return -EINVAL;
+		}
+		cache_size = 0;
+		max_snapshots = 0;
+		integrity = false;
+		nr_hw_queues = 1;
+		poll_queues = 0;
+		hw_queue_depth = min(hw_queue_depth, BDEV_RING_MAX_DEPTH);
+		max_hw_sectors = min(max_hw_sectors, BDEV_RING_BUF_SIZE >> SECTOR_SHIFT);
+		max_segment_size = min(max_segment_size, BDEV_RING_BUF_SIZE);
+	}
+	if(max_snapshots < 0)
+		max_snapshots = 0;
+	if(zone_nr_conv < 0)
+		zone_nr_conv = 0;
+	if(zone_max_open < 0)
+		zone_max_open = 0;
+	if(zone_max_active < 0)
+		zone_max_active = 0;
+
+	if(irqmode < BDEV_IRQ_NONE || irqmode > BDEV_IRQ_TIMER) {
+		printk(KERN_WARNING "bdev: invalid irqmode %d, using 0\n", irqmode);
+		irqmode = BDEV_IRQ_NONE;
+	}
+
+	bdev_slot_cache = KMEM_CACHE(bdev_slot, 0);
+	if(!bdev_slot_cache)
+		return -ENOMEM;
+
+	/*
+	 * Checksumming can be switched on per device later, so the
+	 * transform is set up regardless; without it integrity is
+	 * just unavailable.
+	 */
+	bdev_csum_tfm = crypto_alloc_shash("crc32c", 0, 0);
+	if(IS_ERR(bdev_csum_tfm)) {
+		bdev_csum_tfm = NULL;
+		if(integrity)
+			printk(KERN_WARNING "bdev: crc32c not available, integrity is off\n");
+		integrity = false;
+	}
+	else {
+		bdev_zero_csum = bdev_csum(page_address(ZERO_PAGE(0)));
+		if(integrity)
+			printk(KERN_INFO "bdev: checksumming with %s\n",
+				crypto_shash_driver_name(bdev_csum_tfm));
+	}
+
+	if(compress) {
+		err = bdev_comp_init();
+		if(err)
+			goto out_slot_cache;
+		printk(KERN_INFO "bdev: compressing with %s\n", comp_algorithm);
+	}
+
 	// Try to get a major number
 	bdev_major = register_blkdev(bdev_major, DEVICE_NAME);
 	if(bdev_major <= 0) {
 		printk(KERN_WARNING "bdev: unable to get major number\n");
-		return -EBUSY;
+		err = -EBUSY;
+		goto out_comp;
 	}
 
 	printk(KERN_INFO "bdev: got major number %d\n", bdev_major);
 
-	// Allocate the devices array
-	devices = kmalloc(num_devices * sizeof(struct bdev), GFP_KERNEL);
+	// Not fatal if debugfs isn't available, devices just won't show up there
+	bdev_debugfs_root = debugfs_create_dir(DEVICE_NAME, NULL);
+	if(IS_ERR(bdev_debugfs_root))
+		bdev_debugfs_root = NULL;
+
+	/*
+	 * Allocate the devices array, with room for snapshots at the
+	 * end. It only holds pointers; each device is allocated when
+	 * it's set up, so with lazy unused devices cost next to nothing.
+	 */
+	devices = kvcalloc(num_devices + max_snapshots, sizeof(struct bdev *), GFP_KERNEL);
 	if(devices == NULL) {
-		unregister_blkdev(bdev_major, DEVICE_NAME);
-		return -ENOMEM;
+		err = -ENOMEM;
+		goto out_unregister;
+	}
+
+	if(shared_tags && setup_tag_set(&bdev_shared_set, NUMA_NO_NODE)) {
+		printk(KERN_WARNING "bdev: shared tag set allocation failure\n");
+		err = -ENOMEM;
+		goto out_devices;
 	}
 
-	printk(KERN_INFO "bdev: allocated device memory\n");
-	printk(KERN_INFO "bdev: %d devices requested\n", num_devices);
+	bdev_dbg("allocated device memory\n");
+	printk(KERN_INFO "bdev: %d devices requested (%d hw queues, %d poll queues, depth %d%s)\n",
+		num_devices, nr_hw_queues, poll_queues, hw_queue_depth,
+		shared_tags ? ", shared" : "");
+	bdev_report_overhead();
+
+	// Snapshots go after the primary devices, set up or not
+	nr_devices = num_devices;
 
-	// Set up each individual device
-	for(i = 0; i < num_devices; i++)
-		setup_device(devices + i, i);
+	// Set up each individual device, or leave it until it's opened
+	if(lazy) {
+		blk_register_region(MKDEV(bdev_major, 0), num_devices * bdev_minors,
+							THIS_MODULE, bdev_probe, NULL, NULL);
+	}
+	else {
+		for(i = 0; i < num_devices; i++)
+			bdev_create(i, (u64) num_sectors * dev_sector_size, NULL);
+	}
 
 	return 0;
 
+out_devices:
+	kvfree(devices);
+out_unregister:
+	debugfs_remove_recursive(bdev_debugfs_root);
+	unregister_blkdev(bdev_major, DEVICE_NAME);
+out_comp:
+	bdev_comp_exit();
+out_slot_cache:
+	if(bdev_csum_tfm)
+		crypto_free_shash(bdev_csum_tfm);
+	kmem_cache_destroy(bdev_slot_cache);
+	return err;
 }
 
 /*
@@ -262,22 +4488,67 @@ static void __exit close_module(void)
 
 	printk(KERN_INFO "bdev: exiting module\n");
 
-	for(i = 0; i < num_devices; i++) {
-		struct bdev *dev = devices + i;
+	// No more devices coming into being on open
+	if(lazy)
+		blk_unregister_region(MKDEV(bdev_major, 0), num_devices * bdev_minors);
+
+	// Remove the stats files before the devices they point at go away
+	debugfs_remove_recursive(bdev_debugfs_root);
+
+	for(i = 0; i < nr_devices; i++) {
+		struct bdev *dev = devices[i];
+
+		// Never opened with lazy
+		if(!dev)
+			continue;
 
 		if(dev->gd) 
 			del_gendisk(dev->gd);
 
-		if(dev->queue)
+		/*
+		 * Requests held back by the bandwidth cap or a full write
+		 * cache need the timer or the writeback worker to restart
+		 * the queues, so both keep running until the queue has
+		 * drained. Once it's frozen nothing can stop the queues
+		 * again, and they're stopped for good before the queue is
+		 * torn down so neither can touch it afterwards. The disk
+		 * still holds a queue reference.
+		 */
+		if(dev->queue) {
+			if(dev->gd) {
+				blk_mq_freeze_queue(dev->queue);
+				hrtimer_cancel(&dev->bw_timer);
+				cancel_work_sync(&dev->cache.work);
+			}
 			blk_cleanup_queue(dev->queue);
+			if(dev->set == &dev->tag_set)
+				blk_mq_free_tag_set(&dev->tag_set);
+		}
 
-		if(dev->data)
-			vfree(dev->data);
+		if(dev->gd)
+			put_disk(dev->gd);
+
+		bdev_ring_destroy(dev);
+		bdev_file_free(dev);
+		bdev_free_cache(dev);
+		bdev_put_store(dev->store);
+		free_percpu(dev->stats);
+		kvfree(dev->csums);
+		kvfree(dev->zones);
+		kfree(dev);
 	}
 
+	// Every queue using it is gone now
+	if(shared_tags)
+		blk_mq_free_tag_set(&bdev_shared_set);
+
 	unregister_blkdev(bdev_major, DEVICE_NAME);
-	kfree(devices);
+	kvfree(devices);
 
+	bdev_comp_exit();
+	if(bdev_csum_tfm)
+		crypto_free_shash(bdev_csum_tfm);
+	kmem_cache_destroy(bdev_slot_cache);
 }
 
 module_init(start_module);
@@ -0,0 +1,160 @@
+/*
+ * Random I/O benchmark for comparing the in-kernel store with the
+ * userspace-served path. Runs direct I/O from several threads for
+ * a fixed time and reports IOPS, bandwidth and mean latency:
+ *
+ *	./bdev_bench /dev/bdeva [-b block size] [-j threads] [-t seconds] [-w write %]
+ *
+ * Load the module with userspace=0, run it, then reload with
+ * userspace=1, start bdev_loopd and run it again.
+ *
+ * Build with: gcc -O2 -Wall -pthread -o bdev_bench bdev_bench.c
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static const char *path;
+static size_t block_size = 4096;
+static int threads = 4;
+static int seconds = 10;
+static int write_pct = 0;
+static uint64_t dev_size;
+static volatile int stop = 0;
+
+struct worker {
+	pthread_t thread;
+	unsigned int seed;
+	uint64_t ios;
+	uint64_t ns;
+	int errors;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *run(void *arg)
+{
+	struct worker *w = arg;
+	uint64_t blocks = dev_size / block_size;
+	uint64_t start;
+	off_t off;
+	void *buf;
+	ssize_t ret;
+	int fd;
+
+	fd = open(path, O_RDWR | O_DIRECT);
+	if(fd < 0 || posix_memalign(&buf, 4096, block_size)) {
+		w->errors++;
+		return NULL;
+	}
+	memset(buf, 0xa5, block_size);
+
+	while(!stop) {
+		off = (off_t) (rand_r(&w->seed) % blocks) * block_size;
+
+		start = now_ns();
+		if((int) (rand_r(&w->seed) % 100) < write_pct)
+			ret = pwrite(fd, buf, block_size, off);
+		else
+			ret = pread(fd, buf, block_size, off);
+		w->ns += now_ns() - start;
+
+		if(ret != (ssize_t) block_size)
+			w->errors++;
+		w->ios++;
+	}
+
+	free(buf);
+	close(fd);
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	struct worker *workers;
+	uint64_t ios = 0, ns = 0;
+	int errors = 0;
+	int opt, i, fd;
+
+	while((opt = getopt(argc, argv, "b:j:t:w:")) != -1) {
+		switch(opt) {
+		case 'b':
+			block_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		case 'w':
+			write_pct = atoi(optarg);
+			break;
+		default:
+			printf("Usage: %s <device> [-b block size] [-j threads] [-t seconds] [-w write %%]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if(optind >= argc || threads < 1 || block_size < 512 || block_size % 512) {
+		printf("Usage: %s <device> [-b block size] [-j threads] [-t seconds] [-w write %%]\n", argv[0]);
+		return 1;
+	}
+	path = argv[optind];
+
+	fd = open(path, O_RDONLY);
+	if(fd < 0 || ioctl(fd, BLKGETSIZE64, &dev_size) < 0) {
+		perror(path);
+		return 1;
+	}
+	close(fd);
+
+	if(dev_size < block_size) {
+		printf("%s is smaller than one block\n", path);
+		return 1;
+	}
+
+	workers = calloc(threads, sizeof(struct worker));
+	for(i = 0; i < threads; i++) {
+		workers[i].seed = i + 1;
+		pthread_create(&workers[i].thread, NULL, run, &workers[i]);
+	}
+
+	sleep(seconds);
+	stop = 1;
+
+	for(i = 0; i < threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		ios += workers[i].ios;
+		ns += workers[i].ns;
+		errors += workers[i].errors;
+	}
+
+	printf("%s: %zu byte blocks, %d threads, %d%% writes, %d s\n",
+		path, block_size, threads, write_pct, seconds);
+	printf("  %.0f IOPS, %.1f MB/s, %.1f us mean latency, %d errors\n",
+		(double) ios / seconds,
+		(double) ios * block_size / seconds / (1024 * 1024),
+		ios ? (double) ns / ios / 1000 : 0.0,
+		errors);
+
+	free(workers);
+	return errors ? 1 : 0;
+}
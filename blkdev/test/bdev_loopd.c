@@ -0,0 +1,165 @@
+/*
+ * Reference daemon for userspace=1. Serves a bdev from a regular
+ * file, one request at a time:
+ *
+ *	insmod blkdev.ko userspace=1 num_sectors=2097152
+ *	truncate -s 1G backing.img
+ *	./bdev_loopd /dev/bdeva-ctl backing.img
+ *
+ * Build with: gcc -O2 -Wall -o bdev_loopd bdev_loopd.c
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../bdev_ring.h"
+
+static volatile sig_atomic_t stop = 0;
+
+static void handle_signal(int sig)
+{
+	stop = 1;
+}
+
+// Runs one request against the backing file, returning 0 or -errno
+static int serve(int fd, struct bdev_ring_sqe *sqe, char *buf)
+{
+	ssize_t done = 0, ret;
+
+	switch(sqe->op) {
+	case BDEV_RING_OP_READ:
+		while(done < sqe->len) {
+			ret = pread(fd, buf + done, sqe->len - done, sqe->offset + done);
+			if(ret < 0)
+				return -errno;
+			if(ret == 0) {
+				// Past the end of the file reads back as zeros
+				memset(buf + done, 0, sqe->len - done);
+				break;
+			}
+			done += ret;
+		}
+		return 0;
+
+	case BDEV_RING_OP_WRITE:
+		while(done < sqe->len) {
+			ret = pwrite(fd, buf + done, sqe->len - done, sqe->offset + done);
+			if(ret < 0)
+				return -errno;
+			done += ret;
+		}
+		if((sqe->flags & BDEV_RING_F_FUA) && fdatasync(fd) < 0)
+			return -errno;
+		return 0;
+
+	case BDEV_RING_OP_FLUSH:
+		return fdatasync(fd) < 0 ? -errno : 0;
+
+	case BDEV_RING_OP_DISCARD:
+	case BDEV_RING_OP_WRITE_ZEROES:
+		if(fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				sqe->offset, sqe->len) < 0)
+			return -errno;
+		return 0;
+
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct bdev_ring_hdr *hdr;
+	struct bdev_ring_sqe *sqes;
+	struct bdev_ring_cqe *cqes;
+	char *map, *bufs;
+	size_t map_size;
+	uint32_t head, tail, cq_tail;
+	int ctl, fd;
+
+	if(argc < 3) {
+		printf("Usage: %s /dev/<disk>-ctl <backing file>\n", argv[0]);
+		return 1;
+	}
+
+	ctl = open(argv[1], O_RDWR);
+	if(ctl < 0) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	fd = open(argv[2], O_RDWR);
+	if(fd < 0) {
+		perror(argv[2]);
+		return 1;
+	}
+
+	// The header says how much there is to map
+	hdr = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, ctl, 0);
+	if(hdr == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	map_size = hdr->map_size;
+	munmap(hdr, sysconf(_SC_PAGESIZE));
+
+	map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, ctl, 0);
+	if(map == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	hdr = (struct bdev_ring_hdr *) map;
+	sqes = (struct bdev_ring_sqe *) (map + hdr->sqes_off);
+	cqes = (struct bdev_ring_cqe *) (map + hdr->cqes_off);
+	bufs = map + hdr->bufs_off;
+
+	printf("Serving %s from %s (%llu bytes, depth %u)\n", argv[1], argv[2],
+		(unsigned long long) hdr->dev_size, hdr->depth);
+
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+
+	while(!stop) {
+		// Hands back what we completed last time and waits for more
+		if(ioctl(ctl, BDEV_RING_IOC_ENTER, BDEV_RING_ENTER_WAIT) < 0) {
+			if(errno == EINTR)
+				continue;
+			perror("ioctl");
+			break;
+		}
+
+		head = hdr->sq_head;
+		tail = __atomic_load_n(&hdr->sq_tail, __ATOMIC_ACQUIRE);
+		cq_tail = hdr->cq_tail;
+
+		for(; head != tail; head++) {
+			struct bdev_ring_sqe *sqe = &sqes[head % hdr->depth];
+			struct bdev_ring_cqe *cqe = &cqes[cq_tail % hdr->depth];
+
+			cqe->tag = sqe->tag;
+			cqe->result = serve(fd, sqe, bufs + (size_t) sqe->tag * hdr->buf_size);
+			cq_tail++;
+		}
+
+		__atomic_store_n(&hdr->sq_head, head, __ATOMIC_RELEASE);
+		__atomic_store_n(&hdr->cq_tail, cq_tail, __ATOMIC_RELEASE);
+	}
+
+	// Post whatever is left before going away
+	ioctl(ctl, BDEV_RING_IOC_ENTER, 0);
+
+	munmap(map, map_size);
+	close(fd);
+	close(ctl);
+	return 0;
+}
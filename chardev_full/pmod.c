@@ -6,6 +6,12 @@
 #include <linux/slab.h>
 #include <linux/uaccess.h>
 #include <linux/mutex.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/math64.h>
+#include <linux/uio.h>
+#include <linux/splice.h>
+#include <linux/mman.h>
 
 #include "pmod.h"
 
@@ -16,87 +22,160 @@ MODULE_LICENSE("GPL");
 static int module_major = MODULE_MAJOR;
 static int module_minor = MODULE_MINOR;
 static int num_devices = NUM_DEVICES;
-static int data_block_size = DATA_BLOCK_SIZE;
+static int pool_pages = POOL_PAGES;
 
 module_param(module_major, int, S_IRUGO);
 module_param(module_minor, int, S_IRUGO);
 module_param(num_devices, int, S_IRUGO);
-module_param(data_block_size, int, S_IRUGO);
+module_param(pool_pages, int, S_IRUGO);
 
 static dev_t dev_number;
 static struct pmod_dev *devices;
 
 static void print_pmod_dev_info(struct pmod_dev *dev) 
 {
-	printk(KERN_INFO "pmod:\tdev->num_blocks = %d\n", dev->num_blocks);
+	printk(KERN_INFO "pmod:\tdev->size = %lld, dev->num_pages = %ld\n", dev->size,
+		atomic_long_read(&dev->num_pages));
 }
 
 /*
- * Creates the required pmod_block structs in the given device.
- * This method does not allocate space for the block_data field
- * in the pmod_data struct.
+ * Prints how much memory the data is taking up and how often
+ * writes had to go to the page allocator. Pages first touched
+ * through a mapping are allocated by the fault and counted
+ * separately, since no write is behind them.
  */
-static struct pmod_block *pmod_get_block(struct pmod_dev *dev, int block_num) 
+static void print_pmod_dev_stats(struct pmod_dev *dev)
 {
-	struct pmod_block *block;
-
-	printk(KERN_INFO "pmod:\tpmod_get_block() called (getting block %d)\n", block_num);
+	long num_pages = atomic_long_read(&dev->num_pages);
+	u64 used = (u64) num_pages * PAGE_SIZE;
+	u64 overhead = dev->size ? div64_u64(used * 100, dev->size) : 0;
+	u64 allocs = dev->bytes_written ?
+		div64_u64((u64) dev->page_allocs << 20, dev->bytes_written) : 0;
+
+	printk(KERN_INFO "pmod:\t%lld bytes stored in %ld pages (%llu.%02llu bytes of memory per byte)\n",
+		dev->size, num_pages, overhead / 100, overhead % 100);
+	printk(KERN_INFO "pmod:\t%lu page allocations, %lu pool reuses, %llu allocations per MB written\n",
+		dev->page_allocs, dev->pool_reuses, allocs);
+	printk(KERN_INFO "pmod:\t%ld page allocations from page faults\n",
+		atomic_long_read(&dev->fault_allocs));
+}
 
-	// If the first block of data isn't allocated, go ahead and get the memory
-	if(!dev->data) {
-		printk(KERN_INFO "pmod:\t\tpmod_dev didn't have any data, so attempting first block allocation...\n");
-		dev->data = kmalloc(sizeof(struct pmod_block), GFP_KERNEL);
-		if(dev->data == NULL)
-			return NULL; // No memeory
-		memset(dev->data, 0, sizeof(struct pmod_block));
+/*
+ * Gets a zeroed page for the device, from the pool if it has
+ * any and from the page allocator otherwise. Device pages are
+ * always marked uptodate: splice hands them to pipes as if they
+ * were page cache pages, and the pipe refuses to pass on a page
+ * that isn't uptodate and has no mapping.
+ */
+static struct page *pmod_alloc_page(struct pmod_dev *dev)
+{
+	struct page *page;
+
+	if(!list_empty(&dev->pool)) {
+		page = list_first_entry(&dev->pool, struct page, lru);
+		list_del(&page->lru);
+		dev->pool_count--;
+		dev->pool_reuses++;
+		clear_page(page_address(page));
+		return page;
+	}
 
-		printk(KERN_INFO "pmod:\t\tallocation successful\n");
+	page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+	if(page) {
+		SetPageUptodate(page);
+		dev->page_allocs++;
+	}
+	return page;
+}
 
-		// We added a block, so increase num of blocks
-		dev->num_blocks++;	
+/*
+ * Gives a page back to the pool, or to the system if the pool is
+ * full. Pages spliced into a pipe are still referenced from there
+ * and can't be reused yet; dropping our reference leaves them to
+ * the pipe.
+ */
+static void pmod_free_page(struct pmod_dev *dev, struct page *page)
+{
+	if(page_count(page) == 1 && dev->pool_count < pool_pages) {
+		list_add(&page->lru, &dev->pool);
+		dev->pool_count++;
 	}
+	else {
+		put_page(page);
+	}
+}
 
-	block = dev->data;
+/*
+ * Gets the page holding the given page number, allocating it if
+ * it doesn't exist yet. Pages in between aren't allocated, so the
+ * device stays sparse.
+ */
+static struct page *pmod_get_page(struct pmod_dev *dev, pgoff_t page_num) 
+{
+	struct page *page, *cur;
 
-	// Loop to create the rest of the required blocks
-	while(0 < block_num--) {
-		if(!block->next) {
-			printk(KERN_INFO "pmod:\t\trequired block doesn't exist, attempting allocation...\n");
-			block->next = kmalloc(sizeof(struct pmod_block), GFP_KERNEL);
-			if(block->next == NULL)
-				return NULL;
-			memset(block->next, 0, sizeof(struct pmod_block));
+	page = xa_load(&dev->pages, page_num);
+	if(page)
+		return page;
 
-			printk(KERN_INFO "pmod:\t\tallocation successful\n");
+	page = pmod_alloc_page(dev);
+	if(page == NULL)
+		return NULL; // No memory
 
-			// We added a block, so increase num of blocks
-			dev->num_blocks++;
-		}
-		block = block->next;
+	// A page fault may have put one there in the meantime
+	cur = xa_cmpxchg(&dev->pages, page_num, NULL, page, GFP_KERNEL);
+	if(cur) {
+		pmod_free_page(dev, page);
+		return xa_is_err(cur) ? NULL : cur;
 	}
 
-	return block;
+	atomic_long_inc(&dev->num_pages);
+	return page;
 }
 
 /*
- * Clears out a device's blocks.
+ * Clears out a device's data. The pages go to the pool so the
+ * writes that usually follow don't need the page allocator. While
+ * the device is mapped the pages stay where they are and are just
+ * zeroed, so the mappings keep seeing what read() sees. map_lock
+ * is held throughout so no new mapping can start faulting in pages
+ * that are being freed. It's a mutex, so this can reschedule
+ * between pages on a large device.
  */
 static void pmod_trim(struct pmod_dev *dev)
 {
-	struct pmod_block *block, *next;
-
-	// Free each pmod_block, and it's block_data if it has any.
-	for(block = dev->data; block; block = next) {
-		if(block->block_data) {
-			kfree(block->block_data);
-			block->block_data = NULL;
+	struct page *page;
+	unsigned long page_num;
+
+	mutex_lock(&dev->map_lock);
+	if(dev->nr_mmaps) {
+		xa_for_each(&dev->pages, page_num, page) {
+			clear_page(page_address(page));
+			cond_resched();
 		}
-		next = block->next;
-		kfree(block);
 	}
+	else {
+		xa_for_each(&dev->pages, page_num, page) {
+			pmod_free_page(dev, page);
+			cond_resched();
+		}
+		xa_destroy(&dev->pages);
+		atomic_long_set(&dev->num_pages, 0);
+	}
+	mutex_unlock(&dev->map_lock);
+
+	dev->size = 0;
+}
+
+// Releases the pool, for when the device goes away
+static void pmod_drain_pool(struct pmod_dev *dev)
+{
+	struct page *page, *next;
 
-	// Set device blocks to 0
-	dev->num_blocks = 0;
+	list_for_each_entry_safe(page, next, &dev->pool, lru)
+		__free_page(page);
+	INIT_LIST_HEAD(&dev->pool);
+	dev->pool_count = 0;
 }
 
 static int pmod_open(struct inode *inode, struct file *filp) 
@@ -118,65 +197,72 @@ static int pmod_open(struct inode *inode, struct file *filp)
 
 static int pmod_release(struct inode *inode, struct file *filp)
 {
+	struct pmod_dev *dev = filp->private_data;
+
 	printk(KERN_INFO "pmod: pmod_release() called.\n");
+
+	mutex_lock(&dev->mut);
+	print_pmod_dev_stats(dev);
+	mutex_unlock(&dev->mut);
+
 	return 0;	
 }
 
-static ssize_t pmod_read(struct file *filp, char __user *buff, size_t count, loff_t *pos)
+/*
+ * Reads and writes copy a page at a time until the iov_iter is
+ * exhausted, holding the device lock for the whole call. If
+ * something goes wrong partway through, the bytes copied so far
+ * are returned. Working on iov_iters covers readv/writev, and
+ * with the generic helpers splice and sendfile too: splicing into
+ * a pipe hands the pipe references to our pages rather than
+ * copying them.
+ */
+static ssize_t pmod_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
-	struct pmod_dev *dev = filp->private_data;
-	struct pmod_block *block;
-	int block_num, block_pos;
-	ssize_t retval;
-
-	printk(KERN_INFO "pmod: pmod_read() called (count: %ld, pos: %lld)\n", count, *pos);
+	struct pmod_dev *dev = iocb->ki_filp->private_data;
+	size_t count = iov_iter_count(to), done = 0, chunk, copied;
+	loff_t pos = iocb->ki_pos;
+	unsigned int page_pos;
+	struct page *page;
+	ssize_t retval = 0;
+
+	printk(KERN_INFO "pmod: pmod_read_iter() called (count: %ld, pos: %lld)\n", count, pos);
 	print_pmod_dev_info(dev);
 
 	// Obtain device lock
-	printk(KERN_INFO "pmod:\ttrying to get lock from device mutex");
 	if(mutex_lock_interruptible(&dev->mut))
 		return -ERESTARTSYS;
 
-	// Get block number and pos
-	block_num = (long) *pos / data_block_size;
-	block_pos = (long) *pos % data_block_size;
-
-	printk(KERN_INFO "pmod:\tblock_num=%d, block_pos=%d\n", block_num, block_pos);
-
-	// Make sure our device has the required number of blocks
-	if(dev->num_blocks <= block_num) {
-		retval = 0;
-		goto out;
-	}
-
-	// Get the block
-	block = pmod_get_block(dev, block_num);
-
-	// Make sure the block has data
-	if(!block || !block->block_data) {
-		retval = 0;
+	// Make sure there's data at this position
+	if(pos >= dev->size)
 		goto out;
-	}
-
-	printk(KERN_INFO "pmod:\tread found block %p\n", block);
-
-	// Only read to the end of this block
-	if(count > data_block_size - block_pos) {
-		count = data_block_size - block_pos;
-		printk(KERN_INFO "pmod:\ttrimming count to %ld\n", count);
-	}
-
-	printk(KERN_INFO "pmod:\tcopying data from kernel buffer to user buffer\n");
 
-	// Try to copy the data
-	if(copy_to_user(buff, block->block_data + block_pos, count)) {
-		retval = -EFAULT;
-		goto out;
+	// Only read to the end of the data
+	if(count > dev->size - pos)
+		count = dev->size - pos;
+
+	while(done < count) {
+		page = xa_load(&dev->pages, pos >> PAGE_SHIFT);
+		page_pos = pos & ~PAGE_MASK;
+		chunk = min_t(size_t, count - done, PAGE_SIZE - page_pos);
+
+		// Pages never written read back as zeros
+		if(page)
+			copied = copy_page_to_iter(page, page_pos, chunk, to);
+		else
+			copied = iov_iter_zero(chunk, to);
+
+		pos += copied;
+		done += copied;
+		if(copied < chunk) {
+			retval = -EFAULT;
+			break;
+		}
+		cond_resched();
 	}
 
 	// Increase file position pointer
-	*pos += count;
-	retval = count;
+	iocb->ki_pos = pos;
 
 	print_pmod_dev_info(dev);
 
@@ -185,91 +271,158 @@ out:
 	mutex_unlock(&dev->mut);
 
 	// Return num of bytes read
-	return retval;
+	return done ? done : retval;
 }
 
-static ssize_t pmod_write(struct file *filp, const char __user *buf, size_t count, loff_t *pos)
+static ssize_t pmod_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-	struct pmod_dev *dev = filp->private_data;
-	struct pmod_block *block;
-	int block_num, block_pos;
-	ssize_t retval;
-
-	printk(KERN_INFO "pmod: pmod_write() called (count: %ld, pos: %lld)\n", count, *pos);
+	struct pmod_dev *dev = iocb->ki_filp->private_data;
+	size_t count = iov_iter_count(from), done = 0, chunk, copied;
+	loff_t pos = iocb->ki_pos;
+	unsigned int page_pos;
+	struct page *page;
+	ssize_t retval = 0;
+
+	printk(KERN_INFO "pmod: pmod_write_iter() called (count: %ld, pos: %lld)\n", count, pos);
 	print_pmod_dev_info(dev);
 
 	// Obtain device lock
-	printk(KERN_INFO "pmod:\ttrying to get lock from device mutex");
 	if(mutex_lock_interruptible(&dev->mut))
 		return -ERESTARTSYS;
 
 	// If the write pos is 0, empty the device data 
-	if(*pos == 0) {
+	if(pos == 0) {
 		printk(KERN_INFO "pmod:\twriting at position 0, so we're emptying the device first");
 		pmod_trim(dev);
 	}
 
-	// Get block number and pos
-	block_num = (long) *pos / data_block_size;
-	block_pos = (long) *pos % data_block_size;
+	while(done < count) {
+		// Grab the page, allocating it if needed
+		page = pmod_get_page(dev, pos >> PAGE_SHIFT);
+		if(!page) {
+			retval = -ENOMEM;
+			break;
+		}
+		page_pos = pos & ~PAGE_MASK;
+		chunk = min_t(size_t, count - done, PAGE_SIZE - page_pos);
+
+		copied = copy_page_from_iter(page, page_pos, chunk, from);
+
+		pos += copied;
+		done += copied;
+		if(pos > dev->size)
+			dev->size = pos;
+		if(copied < chunk) {
+			retval = -EFAULT;
+			break;
+		}
+		cond_resched();
+	}
+	dev->bytes_written += done;
 
-	printk(KERN_INFO "pmod:\tblock_num=%d, block_pos=%d\n", block_num, block_pos);
+	// Increase file position pointer
+	iocb->ki_pos = pos;
 
-	// Grab pointer to block based on block number
-	block = pmod_get_block(dev, block_num);
-	if(!block) {
-		retval = -ENOMEM;
-		goto out;
-	}
+	print_pmod_dev_info(dev);
 
-	printk(KERN_INFO "pmod:\twrite found block %p\n", block);
+	// Unlock
+	mutex_unlock(&dev->mut);
 
-	// Make sure block data memory is allocated
-	if(!block->block_data) {
-		printk(KERN_INFO "pmod:\tblock data was not allocated. attempting allocation...\n");
-		block->block_data = (char *) kmalloc(data_block_size * sizeof(char), GFP_KERNEL);
-		if(!block->block_data) {
-			retval = -ENOMEM;
-			goto out;
-		}
-		memset(block->block_data, 0, data_block_size * sizeof(char));
-		printk(KERN_INFO "pmod:\tblock data allocated (%ld)\n", data_block_size * sizeof(char));
-	}
+	// Return num of bytes written
+	return done ? done : retval;
+}
 
-	// Only write to the end of the block
-	if(count > data_block_size - block_pos) {
-		count = data_block_size - block_pos;
-		printk(KERN_INFO "pmod:\ttrimming count to %ld\n", count);
-	}
+/*
+ * mmap support. Each page of the mapping is the device's own page
+ * at that offset, so loads and stores through the mapping and
+ * read()/write() all see the same data. Faulting in a page that
+ * doesn't exist yet allocates it, even for reads, so that a later
+ * write() lands in the page that's mapped. Stores through the
+ * mapping don't move the end of the data; read() only goes as far
+ * as write() has.
+ */
+static void pmod_vm_open(struct vm_area_struct *vma)
+{
+	struct pmod_dev *dev = vma->vm_private_data;
+
+	mutex_lock(&dev->map_lock);
+	dev->nr_mmaps++;
+	mutex_unlock(&dev->map_lock);
+}
 
-	printk(KERN_INFO "pmod:\tcopying data from user buffer to kernel buffer\n");
+static void pmod_vm_close(struct vm_area_struct *vma)
+{
+	struct pmod_dev *dev = vma->vm_private_data;
 
-	// Try to copy data
-	if(copy_from_user(block->block_data + block_pos, buf, count)) {
-		retval = -EFAULT;
-		goto out;
+	mutex_lock(&dev->map_lock);
+	dev->nr_mmaps--;
+	mutex_unlock(&dev->map_lock);
+}
+
+static vm_fault_t pmod_vm_fault(struct vm_fault *vmf)
+{
+	struct pmod_dev *dev = vmf->vma->vm_private_data;
+	struct page *page, *cur;
+
+	// Pages aren't freed while we're mapped, so no lock is needed to use one
+	page = xa_load(&dev->pages, vmf->pgoff);
+	if(!page) {
+		// The pool belongs to whoever holds mut, so this can't use it
+		page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+		if(!page)
+			return VM_FAULT_OOM;
+		SetPageUptodate(page);
+		atomic_long_inc(&dev->fault_allocs);
+
+		cur = xa_cmpxchg(&dev->pages, vmf->pgoff, NULL, page, GFP_KERNEL);
+		if(cur) {
+			__free_page(page);
+			if(xa_is_err(cur))
+				return VM_FAULT_OOM;
+			page = cur;
+		}
+		else {
+			atomic_long_inc(&dev->num_pages);
+		}
 	}
 
-	// Increase file position pointer
-	*pos += count;
-	retval = count;
+	// The mapping's reference, the xarray keeps its own
+	get_page(page);
+	vmf->page = page;
+	return 0;
+}
 
-	print_pmod_dev_info(dev);
+static const struct vm_operations_struct pmod_vm_ops = {
+	.open =			pmod_vm_open,
+	.close =		pmod_vm_close,
+	.fault =		pmod_vm_fault,
+};
 
-out:
-	// Unlock
-	mutex_unlock(&dev->mut);
+static int pmod_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct pmod_dev *dev = filp->private_data;
 
-	// Return num of bytes read
-	return retval;
+	printk(KERN_INFO "pmod: pmod_mmap() called (offset: %lu, len: %lu)\n",
+		vma->vm_pgoff << PAGE_SHIFT, vma->vm_end - vma->vm_start);
+
+	vma->vm_ops = &pmod_vm_ops;
+	vma->vm_private_data = dev;
+	vma->vm_flags |= VM_DONTDUMP;
+
+	// ->open isn't called for the first VMA
+	pmod_vm_open(vma);
+	return 0;
 }
 
 static struct file_operations pmod_fops = {
 	.owner =		THIS_MODULE,
 	.open =			pmod_open,
 	.release = 		pmod_release,
-	.read =			pmod_read,
-	.write =		pmod_write,
+	.read_iter =	pmod_read_iter,
+	.write_iter =	pmod_write_iter,
+	.splice_read =	generic_file_splice_read,
+	.splice_write =	iter_file_splice_write,
+	.mmap =			pmod_mmap,
 };
 
 static void init_pmod_dev(struct pmod_dev *dev, int devnum) 
@@ -277,8 +430,13 @@ static void init_pmod_dev(struct pmod_dev *dev, int devnum)
 	int error;
 	dev_t this_dev = MKDEV(module_major, module_minor + devnum);
 
-	// Device starts with 0 blocks
-	dev->num_blocks = 0;
+	// Device starts out empty
+	xa_init(&dev->pages);
+	INIT_LIST_HEAD(&dev->pool);
+	dev->size = 0;
+	atomic_long_set(&dev->num_pages, 0);
+	atomic_long_set(&dev->fault_allocs, 0);
+	mutex_init(&dev->map_lock);
 
 	// Initialize device semaphore
 	mutex_init(&dev->mut);
@@ -306,6 +464,9 @@ int init_module(void)
 	int i;
 	printk(KERN_INFO "pmod: Starting module.\n");
 
+	if(pool_pages < 0)
+		pool_pages = 0;
+
 	/*
 	 * Get the minor numbers for our device. If module_major
 	 * has been specified, ask for that major number. Otherwise
@@ -354,6 +515,7 @@ void cleanup_module(void)
 	if(devices) {
 		for(i = 0; i < num_devices; i++) {
 			pmod_trim(devices + i);
+			pmod_drain_pool(devices + i);
 			cdev_del(&devices[i].cdev);
 		}
 		kfree(devices);
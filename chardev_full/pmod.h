@@ -3,22 +3,42 @@
 
 #include <linux/cdev.h>
 #include <linux/mutex.h>
+#include <linux/xarray.h>
+#include <linux/list.h>
+#include <linux/atomic.h>
 
 #define DEVICE_NAME "pmod"
 #define MODULE_MAJOR 0
 #define MODULE_MINOR 0
 #define NUM_DEVICES 1
-#define DATA_BLOCK_SIZE 32
-
-struct pmod_block {
-	char *block_data;
-	struct pmod_block *next;
-};
+#define POOL_PAGES 256
 
+/*
+ * Data is kept in whole pages, indexed by page number. Pages freed
+ * by a trim go to a per-device pool first and are handed out again
+ * from there before asking the page allocator.
+ *
+ * The pages can also be mmapped. Page faults happen with mmap_lock
+ * held, and reads and writes can fault on the user buffer while
+ * holding mut, so faults never take mut. They insert pages with
+ * xa_cmpxchg() instead, and pages are never freed while the device
+ * is mapped. map_lock only covers nr_mmaps and is never taken
+ * while faulting, so it can be held while a trim works through
+ * every page.
+ */
 struct pmod_dev {
-	struct pmod_block *data;
-	int num_blocks;
+	struct xarray pages;		// Data pages indexed by page number
+	loff_t size;				// One past the highest byte written
+	atomic_long_t num_pages;	// Pages holding data
+	struct list_head pool;		// Free pages, linked through page->lru
+	int pool_count;
+	unsigned long page_allocs;	// Pages that came from the page allocator...
+	unsigned long pool_reuses;	// ...and from the pool
+	atomic_long_t fault_allocs;	// Pages allocated by page faults
+	u64 bytes_written;
 	int device_open;
+	struct mutex map_lock;		// Protects nr_mmaps
+	int nr_mmaps;				// VMAs mapping the device
 	struct mutex mut;
 	struct cdev cdev;
 };
@@ -0,0 +1,211 @@
+/*
+ * Throughput benchmark for reading /dev/pmod three ways: read() and
+ * write() through a userspace buffer like cat does, sendfile(), and
+ * splice() through a pipe.
+ *
+ *	bench [MB] [output file]
+ *
+ * Fills the device with MB megabytes (default 64) and then copies
+ * them to the output file (default /dev/null) with each method.
+ * Finally compares random 8 byte loads through an mmap of the device
+ * with the same loads from ordinary memory.
+ *
+ * Build with: gcc -O2 -Wall -o bench bench.c
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define BUF_SIZE (1024 * 1024)
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static ssize_t copy_cat(int in, int out, size_t len)
+{
+	static char buf[BUF_SIZE];
+	size_t done = 0;
+	ssize_t n;
+
+	while(done < len) {
+		n = read(in, buf, BUF_SIZE);
+		if(n <= 0)
+			break;
+		if(write(out, buf, n) != n)
+			return -1;
+		done += n;
+	}
+	return done;
+}
+
+static ssize_t copy_sendfile(int in, int out, size_t len)
+{
+	off_t off = 0;
+	size_t done = 0;
+	ssize_t n;
+
+	while(done < len) {
+		n = sendfile(out, in, &off, len - done);
+		if(n <= 0)
+			break;
+		done += n;
+	}
+	return done;
+}
+
+static ssize_t copy_splice(int in, int out, size_t len)
+{
+	loff_t off = 0;
+	size_t done = 0;
+	ssize_t n, m;
+	int p[2];
+
+	if(pipe(p) < 0)
+		return -1;
+
+	while(done < len) {
+		n = splice(in, &off, p[1], NULL, len - done, SPLICE_F_MOVE);
+		if(n <= 0)
+			break;
+		while(n > 0) {
+			m = splice(p[0], NULL, out, NULL, n, SPLICE_F_MOVE);
+			if(m <= 0) {
+				close(p[0]);
+				close(p[1]);
+				return -1;
+			}
+			n -= m;
+			done += m;
+		}
+	}
+
+	close(p[0]);
+	close(p[1]);
+	return done;
+}
+
+static void run(const char *name, ssize_t (*copy)(int, int, size_t),
+				const char *out_path, size_t len)
+{
+	double start, secs;
+	ssize_t done;
+	int in, out;
+
+	in = open("/dev/pmod", O_RDONLY);
+	out = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(in < 0 || out < 0) {
+		printf("Error opening files.\n");
+		exit(1);
+	}
+
+	start = now();
+	done = copy(in, out, len);
+	secs = now() - start;
+
+	// A short copy means the method didn't work, not that it was fast
+	if(done < 0 || (size_t) done < len)
+		printf("%-9s failed (%zd of %zu bytes)\n", name, done, len);
+	else
+		printf("%-9s %8.1f MB/s (%zd bytes in %.3f s)\n", name,
+			done / secs / (1024 * 1024), done, secs);
+
+	close(out);
+	close(in);
+}
+
+#define LOADS (10 * 1000 * 1000)
+
+// Mean time of a random 8 byte load from buf, in ns
+static double load_latency(const char *buf, size_t len)
+{
+	volatile unsigned long sink = 0;
+	unsigned int seed = 1;
+	double start;
+	size_t i;
+
+	// Fault everything in first, that's not what's being measured
+	for(i = 0; i < len; i += 4096)
+		sink += buf[i];
+
+	start = now();
+	for(i = 0; i < LOADS; i++)
+		sink += *(const unsigned long *) (buf + (rand_r(&seed) % (len / 8)) * 8);
+	return (now() - start) * 1e9 / LOADS;
+}
+
+static void run_mmap(size_t len)
+{
+	char *map, *mem;
+	int fd;
+
+	fd = open("/dev/pmod", O_RDONLY);
+	if(fd < 0) {
+		printf("Error getting file descriptor.\n");
+		exit(1);
+	}
+
+	map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+	if(map == MAP_FAILED) {
+		printf("%-9s failed\n", "mmap");
+		close(fd);
+		return;
+	}
+
+	mem = malloc(len);
+	memcpy(mem, map, len);
+
+	printf("%-9s %8.1f ns per random load\n", "mmap", load_latency(map, len));
+	printf("%-9s %8.1f ns per random load\n", "memory", load_latency(mem, len));
+
+	free(mem);
+	munmap(map, len);
+	close(fd);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t len = (argc > 1 ? atoi(argv[1]) : 64) * (size_t) BUF_SIZE;
+	const char *out_path = argc > 2 ? argv[2] : "/dev/null";
+	char *buf;
+	size_t done;
+	int fd;
+
+	fd = open("/dev/pmod", O_WRONLY);
+	if(fd < 0) {
+		printf("Error getting file descriptor.\n");
+		return -1;
+	}
+
+	buf = malloc(BUF_SIZE);
+	memset(buf, 'p', BUF_SIZE);
+	for(done = 0; done < len; done += BUF_SIZE) {
+		if(write(fd, buf, BUF_SIZE) != BUF_SIZE) {
+			printf("Error filling the device.\n");
+			return -1;
+		}
+	}
+	free(buf);
+	close(fd);
+
+	printf("Copying %zu MB from /dev/pmod to %s\n", len / BUF_SIZE, out_path);
+	run("cat", copy_cat, out_path, len);
+	run("sendfile", copy_sendfile, out_path, len);
+	run("splice", copy_splice, out_path, len);
+	run_mmap(len);
+
+	return 0;
+}